@@ -0,0 +1,57 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4 // 64^4 ticks, about 4.6 hours at millisecond resolution
+#define TW_NEVER UINT64_MAX
+
+/* A timer embedded in whatever structure needs to expire. A timer is
+ * pending while next is non-NULL. */
+struct tw_timer {
+	struct tw_timer *next;
+	struct tw_timer *prev;
+	uint64_t expires;
+	uint8_t level;
+	uint8_t slot;
+};
+
+/* Hierarchical timing wheel. Level 0 holds timers due within the next
+ * 64 ticks, and each higher level covers 64 times the span of the one
+ * below it. Timers in a higher level slot are cascaded down when the
+ * wheel reaches the start of that slot. */
+struct timerwheel {
+	uint64_t now; // last tick that was processed
+	uint64_t occupied[TW_LEVELS]; // bitmap of non-empty slots per level
+	size_t count;
+	struct tw_timer slots[TW_LEVELS][TW_SIZE];
+};
+
+typedef void (*tw_expire_fn)(struct tw_timer *t, void *arg);
+
+/* Prepare an empty wheel whose clock starts at tick now */
+void tw_init(struct timerwheel *tw, uint64_t now);
+
+/* Schedule t to fire at tick expires. Deadlines in the past fire on the
+ * next advance, deadlines past the wheel's span are clamped to it. t
+ * must not already be pending. */
+void tw_add(struct timerwheel *tw, struct tw_timer *t, uint64_t expires);
+
+/* Cancel a pending timer. Does nothing if t is not pending. */
+void tw_del(struct timerwheel *tw, struct tw_timer *t);
+
+/* Run the clock forward to tick now, calling fn on every timer whose
+ * deadline has passed. Timers are unlinked before fn is called, so fn may
+ * free or re-add them. Returns the number of timers that fired. */
+size_t tw_advance(struct timerwheel *tw, uint64_t now, tw_expire_fn fn, void *arg);
+
+/* Returns the tick at which tw_advance next has work to do, or TW_NEVER
+ * if the wheel is empty. For timers in higher levels this is the time
+ * they cascade, which is never later than their deadline. */
+uint64_t tw_next(struct timerwheel *tw);
+
+#endif /* TIMERWHEEL_H */
@@ -3,8 +3,11 @@
  * @author Kyle Herock
  */
 
+#define _GNU_SOURCE // ppoll
+
 #include <argp.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,7 +24,9 @@
 #include "htonll.h"
 
 #define TRQST_LEN 22
+#define TRESP_SIZE 38
 #define TRESP_LEN 2048
+#define FILTER_LEN 8 // Samples considered by the minimum-delay clock filter
 
 enum trequest_state { REQ_NEW, REQ_TIMEOUT, REQ_COMPLETE };
 
@@ -31,15 +36,35 @@ struct client_arguments {
 	struct sockaddr_in servAddr;
 	int n;
 	time_t t;
+	double rate;
 };
 
 struct trequest {
-	int ttl;
 	enum trequest_state state;
 	double theta;
 	double delta;
 };
 
+// A request's timeout on the monotonic clock, ordered in a binary min-heap
+struct deadline {
+	int64_t when;
+	int seq;
+};
+
+struct deadline_heap {
+	struct deadline *a;
+	size_t len;
+};
+
+// Sliding window of the last FILTER_LEN samples, as in the NTP clock filter
+struct clock_filter {
+	struct { int seq; double theta, delta; } window[FILTER_LEN];
+	int len;
+	int lastSeq; // Newest sample the filter has already selected
+	double *offsets;
+	int offsets_len;
+};
+
 error_t client_parser(int key, char *arg, struct argp_state *state) {
 	struct client_arguments *args = state->input;
 	error_t ret = 0;
@@ -73,6 +98,12 @@ error_t client_parser(int key, char *arg, struct argp_state *state) {
 		}
 		if (!args->t) args->t = -1; // Mimic poll() treatment of the value -1
 		break;
+	case 'r':
+		args->rate = atof(arg);
+		if (args->rate < 0) {
+			argp_error(state, "rate must be a number of requests per second >= 0");
+		}
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -87,6 +118,7 @@ void client_parseopt(struct client_arguments *args, int argc, char *argv[]) {
 		{ "port", 'p', "port", 0, "The port that is being used at the server", 0},
 		{ "timereq", 'n', "timereq", 0, "The number of time requests to send to the server", 0},
 		{ "timeout", 't', "timeout", 0, "The time in seconds to wait after sending or receiving a response before terminating", 0},
+		{ "rate", 'r', "rate", 0, "Pace requests at this many per second and print offset statistics instead of per-request results", 0},
 		{0}
 	};
 
@@ -118,6 +150,82 @@ void client_parseopt(struct client_arguments *args, int argc, char *argv[]) {
 	}
 }
 
+int64_t clockNanos(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void heap_push(struct deadline_heap *h, struct deadline d) {
+	size_t i = h->len++;
+	while (i > 0 && h->a[(i - 1) / 2].when > d.when) {
+		h->a[i] = h->a[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->a[i] = d;
+}
+
+struct deadline heap_pop(struct deadline_heap *h) {
+	struct deadline top = h->a[0], last = h->a[--h->len];
+	size_t i = 0, child;
+	while ((child = 2 * i + 1) < h->len) {
+		if (child + 1 < h->len && h->a[child + 1].when < h->a[child].when) child++;
+		if (last.when <= h->a[child].when) break;
+		h->a[i] = h->a[child];
+		i = child;
+	}
+	h->a[i] = last;
+	return top;
+}
+
+/**
+ * Feed one sample through the filter. Of the last FILTER_LEN samples, the one
+ * with the smallest round trip delay is the least disturbed by queueing, so
+ * only its offset is kept, and only if it hasn't been kept already.
+ */
+void filter_add(struct clock_filter *f, int seq, double theta, double delta) {
+	if (f->len < FILTER_LEN) {
+		f->len++;
+	} else {
+		memmove(f->window, f->window + 1, (FILTER_LEN - 1) * sizeof(f->window[0]));
+	}
+	f->window[f->len - 1].seq = seq;
+	f->window[f->len - 1].theta = theta;
+	f->window[f->len - 1].delta = delta;
+
+	int best = 0;
+	for (int i = 1; i < f->len; i++) {
+		if (f->window[i].delta < f->window[best].delta) best = i;
+	}
+	if (f->window[best].seq > f->lastSeq) {
+		f->lastSeq = f->window[best].seq;
+		f->offsets[f->offsets_len++] = f->window[best].theta;
+	}
+}
+
+int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Linear interpolation between closest ranks of a sorted array
+double quantile(double *sorted, int len, double q) {
+	double pos = q * (len - 1);
+	int i = (int)pos;
+	if (i + 1 >= len) return sorted[len - 1];
+	return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+void print_stats(char *label, double *values, int len) {
+	if (!len) {
+		printf("%s: no samples\n", label);
+		return;
+	}
+	qsort(values, len, sizeof(double), compare_double);
+	printf("%s: n %d min %.6f median %.6f iqr %.6f max %.6f\n", label, len, values[0],
+		quantile(values, len, 0.5), quantile(values, len, 0.75) - quantile(values, len, 0.25), values[len - 1]);
+}
+
 int main(int argc, char *argv[]) {
     struct client_arguments args;
 	client_parseopt(&args, argc, argv);
@@ -129,103 +237,144 @@ int main(int argc, char *argv[]) {
 		perror("socket() failed");
 		exit(1);
 	}
-	sock.events = POLLIN | POLLOUT;
 	fcntl(sock.fd, F_SETFL, O_NONBLOCK);
 
-	struct timespec timeSpec0;
 	struct trequest *trqsts = malloc(args.n * sizeof(struct trequest));
 	for (int i = 0; i < args.n; i++) {
 		trqsts[i].state = REQ_NEW;
-		trqsts[i].ttl = -1;
 	}
+	struct deadline_heap deadlines = { malloc(args.n * sizeof(struct deadline)), 0 };
+	struct clock_filter filter;
+	memset(&filter, 0, sizeof(filter));
+	filter.offsets = malloc(args.n * sizeof(double));
 
 	int seqNum = 1;
-	int timeout = -1;
+	int pending = 0; // Requests sent that have neither completed nor timed out
+	int paced = args.rate > 0;
+	int64_t interval = paced ? (int64_t)(1000000000.0 / args.rate) : 0;
+	int64_t nextSend = clockNanos(CLOCK_MONOTONIC);
 	ssize_t numBytes;
-	time_t lastPoll = time(NULL),
-	       elapsed = 0;
-	
+
 	// Send out TimeRequests
 	*(uint16_t *)TRQST_BUF = htons(0x0417);
-	for (int done = 0; !done; lastPoll += elapsed) switch (poll(&sock, 1, timeout)) {
-	case -1:
-		perror("poll() failed");
-		exit(1);
-	case 0:
-		puts("Waiting");
-		// fall through
-	default:
-		elapsed = time(NULL) - lastPoll;
-		for (int i = 0; i < args.n; i++) {
-			if (trqsts[i].ttl < 0) continue;
-			if (trqsts[i].ttl - elapsed <= 0) {
-				trqsts[i].ttl = -1;
-				trqsts[i].state = REQ_TIMEOUT;
-			} else if (trqsts[i].ttl -= elapsed < timeout || timeout == -1) {
-				timeout = trqsts[i].ttl;
+	while (seqNum <= args.n || pending) {
+		int64_t now = clockNanos(CLOCK_MONOTONIC);
+		while (deadlines.len && deadlines.a[0].when <= now) {
+			struct trequest *trqst = &trqsts[heap_pop(&deadlines).seq - 1];
+			if (trqst->state == REQ_NEW) {
+				trqst->state = REQ_TIMEOUT;
+				pending--;
 			}
 		}
-		if (sock.revents & POLLIN) {
+		if (seqNum > args.n && !pending) break;
+
+		// Wake for whichever comes first: the next paced send or the next timeout
+		int64_t wake = -1;
+		sock.events = POLLIN;
+		if (seqNum <= args.n) {
+			if (!paced || nextSend <= now) {
+				sock.events |= POLLOUT;
+			} else {
+				wake = nextSend;
+			}
+		}
+		if (deadlines.len && (wake < 0 || deadlines.a[0].when < wake)) {
+			wake = deadlines.a[0].when;
+		}
+		struct timespec timeout, *timeoutp = NULL;
+		if (wake >= 0) {
+			int64_t wait = wake > now ? wake - now : 0;
+			timeout.tv_sec = wait / 1000000000;
+			timeout.tv_nsec = wait % 1000000000;
+			timeoutp = &timeout;
+		}
+		if (ppoll(&sock, 1, timeoutp, NULL) < 0) {
+			perror("ppoll() failed");
+			exit(1);
+		}
+
+		// Drain every response that has arrived so high rates don't back up the socket
+		while (sock.revents & POLLIN) {
 			numBytes = recvfrom(sock.fd, TRQST_BUF, TRESP_LEN, 0, NULL, 0);
 			if (numBytes < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) break;
 				perror("recvfrom() failed");
 				exit(1);
 			}
-			int res_seqNum = ntohl(*(uint32_t *)&TRQST_BUF[2]);
-			printf("got %d\n", res_seqNum);
-			struct trequest *trqst = &trqsts[res_seqNum - 1];
 			struct timespec timeSpec2;
 			clock_gettime(CLOCK_REALTIME, &timeSpec2);
+			int res_seqNum = ntohl(*(uint32_t *)&TRQST_BUF[2]);
+			if (numBytes < TRESP_SIZE || res_seqNum < 1 || res_seqNum >= seqNum) continue;
+			if (!paced) printf("got %d\n", res_seqNum);
+			struct trequest *trqst = &trqsts[res_seqNum - 1];
 			if (trqst->state == REQ_NEW) {
-				time_t sec0 = ntohll(*(uint64_t *)&TRQST_BUF[6]),
-					sec1 = ntohll(*(uint64_t *)&TRQST_BUF[22]),
-					sec2 = timeSpec2.tv_sec;
-				long nsec0 = ntohll(*(uint64_t *)&TRQST_BUF[14]),
-					nsec1 = ntohll(*(uint64_t *)&TRQST_BUF[30]),
-					nsec2 = timeSpec2.tv_sec;
-				time_t sec = sec1 - sec0 + sec1 - sec2;
-				long nsec = nsec1 - nsec0 + nsec1 - nsec2;
-				if (nsec < 0) {
-					nsec += 1000000000;
-					sec--;
-				}
-				trqst->theta = (double)sec / 2.0 + (double)nsec / 2000000000.0;
-				trqst->delta = (double)(sec2 - sec0) + (double)(nsec2 - nsec0) / 1000000000.0;
-				trqst->ttl = -1;
+				int64_t t0 = (int64_t)ntohll(*(uint64_t *)&TRQST_BUF[6]) * 1000000000 + (int64_t)ntohll(*(uint64_t *)&TRQST_BUF[14]),
+					t1 = (int64_t)ntohll(*(uint64_t *)&TRQST_BUF[22]) * 1000000000 + (int64_t)ntohll(*(uint64_t *)&TRQST_BUF[30]),
+					t2 = (int64_t)timeSpec2.tv_sec * 1000000000 + timeSpec2.tv_nsec;
+				trqst->theta = (double)((t1 - t0) + (t1 - t2)) / 2000000000.0;
+				trqst->delta = (double)(t2 - t0) / 1000000000.0;
 				trqst->state = REQ_COMPLETE;
+				pending--;
+				filter_add(&filter, res_seqNum, trqst->theta, trqst->delta);
 			}
 		}
-		if (sock.revents & POLLOUT) {
+		// Send everything that is due, catching up if the last wakeup ran late
+		while (sock.revents & POLLOUT && seqNum <= args.n) {
+			struct timespec timeSpec0;
 			clock_gettime(CLOCK_REALTIME, &timeSpec0);
 			*(uint32_t *)&TRQST_BUF[2] = htonl(seqNum);
 			*(uint64_t *)&TRQST_BUF[6] = htonll((uint64_t)timeSpec0.tv_sec);
 			*(uint64_t *)&TRQST_BUF[14] = htonll((uint64_t)timeSpec0.tv_nsec);
 
 			numBytes = sendto(sock.fd, TRQST_BUF, TRQST_LEN, 0, (struct sockaddr *)&args.servAddr, sizeof(args.servAddr));
-			if (errno != EAGAIN) {
-				if (numBytes < 0) {
-					perror("sendto() failed");
-					exit(1);
-				}
-				trqsts[seqNum - 1].ttl = args.t;
-				if (seqNum++ == args.n) sock.events &= ~POLLOUT; // Stop sending after last seqNum
+			if (numBytes < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+				perror("sendto() failed");
+				exit(1);
+			}
+			now = clockNanos(CLOCK_MONOTONIC);
+			if (args.t > 0) {
+				struct deadline d = { now + (int64_t)args.t * 1000000, seqNum };
+				heap_push(&deadlines, d);
 			}
+			pending++;
+			seqNum++;
+			if (!paced) break;
+			nextSend += interval;
+			if (nextSend > now) break;
 		}
-		done = 1;
+	}
+
+	if (paced) {
+		int received = 0, dropped = 0;
+		double *offsets = malloc(args.n * sizeof(double)),
+			*delays = malloc(args.n * sizeof(double));
 		for (int i = 0; i < args.n; i++) {
-			// stop when there aren't any live new requests
-			done &= trqsts[i].ttl == -1 && trqsts[i].state != REQ_NEW;
+			if (trqsts[i].state == REQ_COMPLETE) {
+				offsets[received] = trqsts[i].theta;
+				delays[received++] = trqsts[i].delta;
+			} else {
+				dropped++;
+			}
 		}
-		break;
-	}
-	for (int i = 0; i < args.n; i++) {
-		if (trqsts[i].state == REQ_TIMEOUT) {
-			printf("%d: Dropped\n", i);
-		} else {
-			printf("%d: %.4f %.4f\n", i, trqsts[i].theta, trqsts[i].delta);
+		printf("sent %d received %d dropped %d\n", args.n, received, dropped);
+		print_stats("delay", delays, received);
+		print_stats("offset", offsets, received);
+		print_stats("filtered offset", filter.offsets, filter.offsets_len);
+		free(offsets);
+		free(delays);
+	} else {
+		for (int i = 0; i < args.n; i++) {
+			if (trqsts[i].state == REQ_TIMEOUT) {
+				printf("%d: Dropped\n", i);
+			} else {
+				printf("%d: %.4f %.4f\n", i, trqsts[i].theta, trqsts[i].delta);
+			}
 		}
 	}
 	close(sock.fd);
 	free(trqsts);
+	free(deadlines.a);
+	free(filter.offsets);
 	puts("All done!");
 }
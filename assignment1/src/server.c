@@ -3,9 +3,15 @@
  * @author Kyle Herock
  */
 
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+
 #include <argp.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,27 +25,61 @@
 
 #include "uthash.h"
 #include "htonll.h"
+#include "timerwheel.h"
 
 #define TRQST_LEN 22
 #define TRESP_LEN 38
-#define TTL0 5
+#define IDLE0 120 // Default seconds a client may go unheard from before it is forgotten
+#define MAX_CLIENTS0 65536 // Default number of clients remembered at once
+#define RX_BATCH 32 // Datagrams (or GRO trains of datagrams) taken per recvmmsg()
+#define RX_BUF_LEN 65536 // Room for the largest GRO train
+#define GSO_MAX_SEGS 64 // Kernel limit on segments in one UDP_SEGMENT send
+#define TX_BATCH 32 // Destinations with replies waiting to be sent
 
-static uint8_t TRQST_BUF[TRQST_LEN];
+static uint8_t RX_BUFS[RX_BATCH][RX_BUF_LEN];
 
 // a structure to essentially preserve a client's stack frame across polls
 struct client_frame {
 	struct sockaddr_in sockAddr; // The key for uthash
-	char *addr;
+	char addr[INET_ADDRSTRLEN + 6];
 	int maxSeq;
-	uint8_t *buf;
-	size_t buf_len;
-	time_t ttl;
+	uint64_t lastSeen; // ms on the monotonic clock
+	struct tw_timer timer;
+	struct client_frame *older, *newer; // Neighbors in the table's order of last contact
 	UT_hash_handle hh;
 };
 
+// Every client the server remembers, along with the wheel that forgets them
+struct client_table {
+	struct client_frame *clients;
+	struct timerwheel wheel;
+	uint64_t idle; // ms
+	struct client_frame *oldest, *newest;
+	size_t count, max; // Past max clients, the one heard from least recently goes
+};
+
+// Replies to one destination, sent as a single GSO super-datagram
+struct tx_batch {
+	struct sockaddr_in dest;
+	int count;
+	uint8_t buf[GSO_MAX_SEGS * TRESP_LEN];
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+};
+
+struct tx_queue {
+	int gso; // Whether the socket still accepts UDP_SEGMENT sends
+	int len;
+	int sent; // Batches at the front of the queue already handed to the kernel
+	int seg; // Replies of batch sent already handed over, when they go one at a time
+	struct tx_batch batches[TX_BATCH];
+};
+
 struct server_arguments {
 	int port;
 	double drop_chance;
+	int idle;
+	int max_clients;
+	int offload;
 };
 
 error_t server_parser(int key, char *arg, struct argp_state *state) {
@@ -62,6 +102,21 @@ error_t server_parser(int key, char *arg, struct argp_state *state) {
 		}
 		args->drop_chance = (double)num / 100.0;
 		break;
+	case 'o':
+		args->offload = 0;
+		break;
+	case 'i':
+		args->idle = atoi(arg);
+		if (args->idle <= 0) {
+			argp_error(state, "Idle timeout must be a number of seconds greater than 0");
+		}
+		break;
+	case 'm':
+		args->max_clients = atoi(arg);
+		if (args->max_clients <= 0) {
+			argp_error(state, "Client limit must be a number greater than 0");
+		}
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -71,10 +126,16 @@ error_t server_parser(int key, char *arg, struct argp_state *state) {
 
 void *server_parseopt(struct server_arguments *args, int argc, char *argv[]) {
 	memset(args, 0, sizeof(*args));
+	args->idle = IDLE0;
+	args->max_clients = MAX_CLIENTS0;
+	args->offload = 1;
 
 	struct argp_option options[] = {
 		{ "port", 'p', "port", 0, "The port to be used for the server" , 0 },
 		{ "drop", 'd', "drop", 0, "The percent chance a given packet will be dropped. Zero by default", 0 },
+		{ "idle", 'i', "idle", 0, "Seconds of silence after which a client is forgotten. 120 by default", 0 },
+		{ "max-clients", 'm', "max-clients", 0, "Clients remembered at once, the least recently heard from is forgotten first. 65536 by default", 0 },
+		{ "no-offload", 'o', 0, 0, "Send and receive one datagram at a time instead of using UDP GSO/GRO", 0 },
 		{0}
 	};
 	struct argp argp_settings = { options, server_parser, 0, 0, 0, 0, 0 };
@@ -90,71 +151,243 @@ void *server_parseopt(struct server_arguments *args, int argc, char *argv[]) {
 	return args;
 }
 
+uint64_t monotonicMillis() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void handleIncomingClient(struct sockaddr_in *remaddr, struct client_frame *locals) {
 	memset(locals, 0, sizeof(*locals));
 	memcpy(&locals->sockAddr, remaddr, sizeof(locals->sockAddr));
-	locals->addr = malloc(INET_ADDRSTRLEN + 6); // String to contain client address
 	inet_ntop(AF_INET, &locals->sockAddr.sin_addr.s_addr, locals->addr, INET_ADDRSTRLEN);
 	sprintf(locals->addr + strlen(locals->addr), ":%d", ntohs(remaddr->sin_port));
-	locals->addr = realloc(locals->addr, strlen(locals->addr) + 1);
-	locals->buf = malloc(TRESP_LEN);
 }
 
-int handleIncomingMessage(int sock, struct client_frame **clients) {
-	struct client_frame *locals;
-	struct sockaddr_in remaddr;
-	socklen_t remaddr_len = sizeof(remaddr);
-	memset(&remaddr, 0, remaddr_len);
-	struct timespec timeSpec1;
-	clock_gettime(CLOCK_REALTIME, &timeSpec1);
-	if (recvfrom(sock, TRQST_BUF, TRQST_LEN, 0, (struct sockaddr *)&remaddr, &remaddr_len) < 0) {
-		perror("recvfrom() failed");
-		exit(1);
+// Take a client out of the order of last contact
+void unlinkClient(struct client_table *table, struct client_frame *locals) {
+	if (locals->older) locals->older->newer = locals->newer;
+	else table->oldest = locals->newer;
+	if (locals->newer) locals->newer->older = locals->older;
+	else table->newest = locals->older;
+	locals->older = locals->newer = NULL;
+}
+
+// Make a client the most recently heard from
+void touchClient(struct client_table *table, struct client_frame *locals) {
+	if (table->newest == locals) return;
+	if (locals->older || locals->newer || table->oldest == locals) unlinkClient(table, locals);
+	locals->older = table->newest;
+	if (table->newest) table->newest->newer = locals;
+	else table->oldest = locals;
+	table->newest = locals;
+}
+
+void forgetClient(struct client_table *table, struct client_frame *locals) {
+	HASH_DEL(table->clients, locals);
+	tw_del(&table->wheel, &locals->timer);
+	unlinkClient(table, locals);
+	table->count--;
+	free(locals);
+}
+
+/**
+ * Called by the wheel when a client's idle deadline passes. Clients are not
+ * rescheduled on every request, so one that was heard from since its timer
+ * was armed just gets pushed back to its real deadline.
+ */
+void expireClient(struct tw_timer *t, void *arg) {
+	struct client_table *table = arg;
+	struct client_frame *locals = (struct client_frame *)((char *)t - offsetof(struct client_frame, timer));
+	uint64_t deadline = locals->lastSeen + table->idle;
+	if (deadline > table->wheel.now) {
+		tw_add(&table->wheel, t, deadline);
+		return;
 	}
-	HASH_FIND(hh, *clients, &remaddr, remaddr_len, locals);
+	forgetClient(table, locals);
+}
+
+/**
+ * Send every queued batch. A batch holding more than one reply goes out as
+ * one UDP_SEGMENT send that the kernel splits into TRESP_LEN datagrams.
+ * Returns nonzero if the socket filled up before the queue was drained.
+ */
+int flushOutgoingBuffers(int sock, struct tx_queue *tx) {
+	struct mmsghdr msgs[TX_BATCH * GSO_MAX_SEGS];
+	struct iovec iovs[TX_BATCH * GSO_MAX_SEGS];
+	int batchOf[TX_BATCH * GSO_MAX_SEGS]; // Batch each message came from
+	int segOf[TX_BATCH * GSO_MAX_SEGS]; // and which of its replies it is
+	int len = 0;
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = tx->sent; i < tx->len; i++) {
+		struct tx_batch *batch = &tx->batches[i];
+		int segs = tx->gso ? 1 : batch->count;
+		for (int j = i == tx->sent ? tx->seg : 0; j < segs; j++) {
+			struct msghdr *hdr = &msgs[len].msg_hdr;
+			iovs[len].iov_base = batch->buf + j * TRESP_LEN;
+			iovs[len].iov_len = tx->gso ? batch->count * TRESP_LEN : TRESP_LEN;
+			hdr->msg_iov = &iovs[len];
+			hdr->msg_iovlen = 1;
+			hdr->msg_name = &batch->dest;
+			hdr->msg_namelen = sizeof(batch->dest);
+			if (tx->gso && batch->count > 1) {
+				hdr->msg_control = batch->control;
+				hdr->msg_controllen = sizeof(batch->control);
+				struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				*(uint16_t *)CMSG_DATA(cmsg) = TRESP_LEN;
+			}
+			segOf[len] = j;
+			batchOf[len++] = i;
+		}
+	}
+	int done = 0;
+	while (done < len) {
+		int numSent = sendmmsg(sock, msgs + done, len - done, 0);
+		if (numSent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Pick up from the first reply that wasn't sent on the next POLLOUT
+				tx->sent = batchOf[done];
+				tx->seg = segOf[done];
+				return 1;
+			} else if (tx->gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+				puts("UDP GSO unavailable, sending datagrams individually");
+				tx->gso = 0;
+				tx->sent = batchOf[done];
+				tx->seg = 0;
+				return flushOutgoingBuffers(sock, tx);
+			}
+			perror("sendmmsg() failed");
+			exit(1);
+		}
+		done += numSent;
+	}
+	tx->len = tx->sent = tx->seg = 0;
+	return 0;
+}
+
+// Find or start the batch for dest, flushing the queue if it has no room left
+struct tx_batch *getBatch(int sock, struct tx_queue *tx, struct sockaddr_in *dest) {
+	for (int i = tx->len - 1; i >= tx->sent; i--) {
+		struct tx_batch *batch = &tx->batches[i];
+		if (batch->count < GSO_MAX_SEGS && !memcmp(&batch->dest, dest, sizeof(*dest))) {
+			return batch;
+		}
+	}
+	if (tx->len == TX_BATCH && flushOutgoingBuffers(sock, tx)) {
+		return NULL;
+	}
+	struct tx_batch *batch = &tx->batches[tx->len++];
+	batch->dest = *dest;
+	batch->count = 0;
+	return batch;
+}
+
+int handleRequest(int sock, struct client_table *table, struct tx_queue *tx,
+		struct sockaddr_in *remaddr, uint8_t *req, struct timespec *timeSpec1, uint64_t now) {
+	struct client_frame *locals;
+	HASH_FIND(hh, table->clients, remaddr, sizeof(*remaddr), locals);
 	if (locals == NULL) {
+		if (table->count == table->max) {
+			forgetClient(table, table->oldest);
+		}
 		locals = malloc(sizeof(struct client_frame));
-		handleIncomingClient(&remaddr, locals);
-		HASH_ADD(hh, *clients, sockAddr, remaddr_len, locals);
+		handleIncomingClient(remaddr, locals);
+		HASH_ADD(hh, table->clients, sockAddr, sizeof(*remaddr), locals);
+		tw_add(&table->wheel, &locals->timer, now + table->idle);
+		table->count++;
 		puts("Incoming client");
 	}
+	locals->lastSeen = now;
+	touchClient(table, locals);
 
-	if (ntohs(*(uint16_t *)TRQST_BUF) != 0x0417) {
-		printf("Client sent TimeRequest with bad ID (0x%04x)\n", ntohs(*(uint16_t *)TRQST_BUF));
+	if (ntohs(*(uint16_t *)req) != 0x0417) {
+		printf("Client sent TimeRequest with bad ID (0x%04x)\n", ntohs(*(uint16_t *)req));
 		return -1;
-	} else {
-		uint8_t *buf = locals->buf;
-		memcpy(buf, TRQST_BUF, TRQST_LEN);
-		int seq = ntohl(*(uint32_t *)&buf[2]);
-		if (locals->maxSeq < seq) {
-			printf("%s %d %d\n", locals->addr, locals->maxSeq, seq);
-			locals->maxSeq = seq;
-			locals->ttl = TTL0;
-		}
-		*(uint64_t *)&buf[22] = htonll((uint64_t)timeSpec1.tv_sec);
-		*(uint64_t *)&buf[30] = htonll((uint64_t)timeSpec1.tv_nsec);
 	}
+	struct tx_batch *batch = getBatch(sock, tx, remaddr);
+	if (!batch) {
+		return -1; // Socket buffer is full, so this reply is lost like any other UDP datagram
+	}
+	uint8_t *buf = batch->buf + batch->count++ * TRESP_LEN;
+	memcpy(buf, req, TRQST_LEN);
+	int seq = ntohl(*(uint32_t *)&buf[2]);
+	if (locals->maxSeq < seq) {
+		printf("%s %d %d\n", locals->addr, locals->maxSeq, seq);
+		locals->maxSeq = seq;
+	}
+	*(uint64_t *)&buf[22] = htonll((uint64_t)timeSpec1->tv_sec);
+	*(uint64_t *)&buf[30] = htonll((uint64_t)timeSpec1->tv_nsec);
 	return 0;
 }
 
-void flushOutgoingBuffers(int sock, struct client_frame **clients) {
-	struct client_frame *locals, *tmp;
-	HASH_ITER(hh, *clients, locals, tmp) {
-		struct sockaddr_in *sockAddr = &locals->sockAddr;
-		uint8_t *buf = locals->buf;
-		if (sendto(sock, buf, TRESP_LEN, 0, (struct sockaddr *)sockAddr, sizeof(*sockAddr)) < 0) {
-			perror("send() failed");
-			exit(1);
+/**
+ * Take up to RX_BATCH datagrams off the socket. With UDP_GRO enabled, one
+ * message may be a train of same-sized datagrams from a single sender,
+ * which is split back into its TimeRequests here.
+ */
+int handleIncomingMessages(int sock, struct client_table *table, struct tx_queue *tx, struct server_arguments *args) {
+	static struct mmsghdr msgs[RX_BATCH];
+	static struct iovec iovs[RX_BATCH];
+	static struct sockaddr_in remaddrs[RX_BATCH];
+	static char controls[RX_BATCH][CMSG_SPACE(sizeof(int))];
+	for (int i = 0; i < RX_BATCH; i++) {
+		iovs[i].iov_base = RX_BUFS[i];
+		iovs[i].iov_len = args->offload ? RX_BUF_LEN : TRQST_LEN;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &remaddrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(remaddrs[i]);
+		msgs[i].msg_hdr.msg_control = controls[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+	}
+	struct timespec timeSpec1;
+	clock_gettime(CLOCK_REALTIME, &timeSpec1);
+	int numMsgs = recvmmsg(sock, msgs, args->offload ? RX_BATCH : 1, 0, NULL);
+	if (numMsgs < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		perror("recvmmsg() failed");
+		exit(1);
+	}
+	uint64_t now = monotonicMillis();
+	for (int i = 0; i < numMsgs; i++) {
+		size_t len = msgs[i].msg_len, segment = len;
+		struct msghdr *hdr = &msgs[i].msg_hdr;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+				segment = *(int *)CMSG_DATA(cmsg);
+			}
+		}
+		for (size_t off = 0; off < len; off += segment) {
+			if (rand() < args->drop_chance * ((double)RAND_MAX + 1.0)) {
+				puts("dropping packet");
+			} else if (len - off >= TRQST_LEN) {
+				handleRequest(sock, table, tx, &remaddrs[i], RX_BUFS[i] + off, &timeSpec1, now);
+			}
 		}
 	}
+	return numMsgs;
 }
 
 int main(int argc, char *argv[]) {
-	struct client_frame *clients = NULL;
+	struct client_table table;
     struct server_arguments args;
 	server_parseopt(&args, argc, argv);
 	srand(time(NULL));
 
+	table.clients = NULL;
+	table.idle = 1000 * (uint64_t)args.idle;
+	table.oldest = table.newest = NULL;
+	table.count = 0;
+	table.max = args.max_clients;
+	tw_init(&table.wheel, monotonicMillis());
+
+	static struct tx_queue tx;
+	tx.gso = args.offload;
+	tx.len = tx.sent = tx.seg = 0;
+
  	// Create socket for incoming connections
 	struct pollfd sock;
 	sock.fd = socket(AF_INET, SOCK_DGRAM, 0); // Socket descriptor for server
@@ -177,30 +410,38 @@ int main(int argc, char *argv[]) {
 		perror("bind() failed");
 		exit(1);
 	}
+
+	// Let the kernel hand over bursts from one sender as a single GRO train
+	int on = 1;
+	if (args.offload && setsockopt(sock.fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+		perror("setsockopt(UDP_GRO) failed");
+	}
 	 
-	time_t min_ttl = -1;
-	for (;;) switch (poll(&sock, 1, min_ttl)) { // Run forever
-	case -1:
-		perror("poll() failed");
-		exit(1);
-	case 0:
-		puts("Waiting for activity");
-		break;
-	default:
-		if (sock.revents & POLLIN) {
-			if (rand() >= args.drop_chance * ((double)RAND_MAX + 1.0)) {
-				if (handleIncomingMessage(sock.fd, &clients) < 1) {
-					sock.events |= POLLOUT & ~POLLIN;
-				}
+	for (;;) { // Run forever
+		// Sleep no longer than it takes for the next client to go idle
+		uint64_t now = monotonicMillis(), next = tw_next(&table.wheel);
+		int timeout = -1;
+		if (next != TW_NEVER) {
+			timeout = next <= now ? 0 : next - now > INT_MAX ? INT_MAX : (int)(next - now);
+		}
+		switch (poll(&sock, 1, timeout)) {
+		case -1:
+			perror("poll() failed");
+			exit(1);
+		case 0:
+			break;
+		default:
+			if (sock.revents & POLLIN) {
+				handleIncomingMessages(sock.fd, &table, &tx, &args);
+			}
+			// Replies go out as soon as they are batched unless the socket is full
+			if (tx.len && flushOutgoingBuffers(sock.fd, &tx)) {
+				sock.events = POLLOUT;
 			} else {
-				puts("dropping packet");
-				recvfrom(sock.fd, TRQST_BUF, TRQST_LEN, 0, NULL, 0); // drop the packet
+				sock.events = POLLIN | POLLPRI;
 			}
+			break;
 		}
-		if (sock.revents & POLLOUT) {
-			flushOutgoingBuffers(sock.fd, &clients);
-			sock.events |= POLLIN & ~POLLOUT;
-		}
-		break;
+		tw_advance(&table.wheel, monotonicMillis(), expireClient, &table);
 	}
 }
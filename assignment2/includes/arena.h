@@ -0,0 +1,28 @@
+/* $Id$
+ * Region allocator
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Objects that live as long as the scenario are carved out of big chunks
+ * instead of being malloc'd one by one, and are all released together
+ * by arena_free. Chunks double in size, so a scenario of any size is a
+ * few dozen of them.
+ */
+struct chunk;
+
+struct arena {
+    struct chunk *chunk;  // newest chunk, it links to the older ones
+    char *cur, *end;      // free space left in the newest chunk
+    size_t next;          // size of the next chunk
+};
+
+#define ARENA_ALIGN 16
+
+void *arena_alloc(struct arena *a, size_t size);
+void arena_free(struct arena *a);
+
+#endif
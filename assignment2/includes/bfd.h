@@ -0,0 +1,59 @@
+/* $Id$
+ * Neighbor liveness, after BFD (RFC 5880)
+ */
+#ifndef _BFD_H_
+#define _BFD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "tw.h"
+
+/*
+ * Hellos go on the link sockets next to routing updates:
+ *
+ *   0       1       2       3       4
+ *   +-------+-------+-------+-------+
+ *   | type  |version| state | mult  |
+ *   +-------+-------+-------+-------+
+ *   |   hello interval, ms (network)|
+ *   +-------------------------------+
+ *
+ * state is what the sender thinks of the session. A session comes up
+ * with the three-way handshake of BFD: Down hearing Down goes to Init,
+ * Init or Down hearing Init goes to Up, and hearing Down while Up tears
+ * it down. The peer is declared down when mult of its intervals pass
+ * without a hello.
+ */
+#define BFD_TYPE    0x9
+#define BFD_VERSION 0x1
+#define BFD_LEN     8
+
+#define BFD_DOWN    1
+#define BFD_INIT    2
+#define BFD_UP      3
+
+struct link;
+
+/* one session per adjacency, embedded in its link */
+struct bfd {
+    uint8_t state;
+    uint8_t rmult;           // the peer's detect multiplier
+    uint32_t rint;           // and hello interval, ms
+    struct tw_timer tx;      // next hello
+    struct tw_timer detect;  // peer declared down
+};
+
+/* hellos every bfd_interval ms, 0 for none; set before dv_init */
+extern unsigned int bfd_interval;
+extern unsigned int bfd_mult;
+
+/* routing only believes a neighbor that is up, when there are hellos */
+#define bfd_alive(l) (!bfd_interval || (l)->bfd.state == BFD_UP)
+
+void bfd_start(struct link *l, uint64_t now);
+void bfd_stop(struct link *l);
+bool bfd_input(struct link *l, uint8_t *buf, size_t len, uint64_t now); // false if not a hello
+void bfd_resume(struct link *l, uint64_t t); // timers again from t after bfd_stop, the session as it was
+
+#endif
@@ -11,6 +11,9 @@
 typedef unsigned int node;
 typedef unsigned int cost;
 
+#define NO_NODE ((node)-1)
+#define INF_COST ((cost)-1)
+
 typedef enum {
     false,
     true
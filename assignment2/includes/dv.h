@@ -0,0 +1,157 @@
+/* $Id$
+ * Distance Vector routing
+ */
+#ifndef _DV_H_
+#define _DV_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "tw.h"
+
+/*
+ * Update wire format:
+ *
+ *   0       1       2       3       4
+ *   +-------+-------+-------+-------+
+ *   | type  |version| flags |   0   |
+ *   +-------+-------+-------+-------+
+ *   |       sequence (network)      |
+ *   +-------------------------------+
+ *   then until the end of the datagram: varint(gap), varint(cost)
+ *
+ * Destinations go in increasing order and gap is how many ids were
+ * skipped since the previous one (the first is relative to -1), so a
+ * dense table costs one byte per id. Costs are sent plus one, 0 meaning
+ * unreachable. Varints are little endian base 128, as in protobuf.
+ *
+ * Every datagram of one update shares its sequence number and stands on
+ * its own. A full update has every route, a DV_DELTA one only the routes
+ * that changed since the previous update; deltas older than the last
+ * update seen on the link are dropped.
+ */
+#define DV_TYPE     0x7
+#define DV_VERSION  0x2
+#define DV_DELTA    0x1
+#define DV_HDR      8
+#define DV_ENTRY    10     // largest encoded (gap, cost)
+#define DV_MTU      1500   // if the path MTU cannot be read
+#define DV_MAXDGRAM 65507  // largest UDP payload
+#define DV_EVENTS   256    // sockets handled per wakeup
+#define DV_DENSE    8      // a datagram changing one in this many ids goes to rt_relax
+
+/* timers, in update periods as in RIP (30 s updates, 180 s timeout, 120 s gc) */
+#define DV_TIMEOUT  6      // a neighbor not heard from this long is gone
+#define DV_GC       4      // unreachable routes are advertised this long
+#define DV_LFA_QUIET 200   // ms without a route change before alternates are recomputed
+
+/* link cost damping, after RFC 2439 route-flap damping and its usual defaults */
+#define DV_DAMP_PENALTY  1000  // what a change of cost adds
+#define DV_DAMP_SUPPRESS 2000  // the cost is held above this
+#define DV_DAMP_REUSE    750   // and let go once it decays below this
+#define DV_DAMP_CEIL     (DV_DAMP_REUSE << 4)  // suppressed 4 half-lives at most
+
+struct link;
+struct iovec;
+struct lsr;
+
+/*
+ * What one router did over a window, normally from one event set to the
+ * next. A flap is a change to a route that already changed in the
+ * window.
+ */
+struct dv_stats {
+    uint64_t since;            // start of the window
+    uint64_t last_change;      // when a route last changed, 0 if none did
+    unsigned long changes, flaps;
+    unsigned long tx_msgs, tx_bytes;
+    unsigned long rx_msgs, rx_bytes;
+    unsigned long hello_tx, hello_rx;  // bfd.c's, kept out of the counts above
+    unsigned long switched;    // routes moved to an alternate by a link going or getting dearer
+    unsigned long damped;      // links damping started to hold
+    uint64_t *seen;            // bit d set if d changed in the window
+};
+
+/*
+ * Protocol state of one router. Like g_ls and g_rt there is one of these
+ * per process, the simulator swaps all three to play many routers.
+ *
+ * Everything that happens later is a timer on the router's wheel: the
+ * jittered periodic update, the hold-down queue, one timeout per
+ * neighbor and whatever the driver schedules with dv_schedule.
+ * In link-state mode the same timers drive lsr.c: the periodic update
+ * becomes a hello and triggered updates become floods.
+ */
+struct dv {
+    node me;
+    unsigned int update_ms;   // between full updates, on average
+    unsigned int holddown_ms;
+    int verbose;
+    cost inf;                 // paths this expensive must loop
+    node cap;                 // size of the per-node arrays below
+    uint64_t *changed;        // bit d set if d changed since the last update
+    bool dirty;
+    uint8_t *age;             // full updates d has been unreachable for, see DV_GC
+    uint64_t *hd_until;       // route to d is held down until then, 0x0 until needed
+    cost *hd_cost;            // what d cost before it got worse
+    node *hd_q;               // held routes in expiry order, a ring
+    size_t hd_head, hd_len, hd_qcap;
+    struct timerwheel tw;
+    struct tw_timer periodic;
+    struct tw_timer holddown; // expiry of the route at the head of hd_q
+    node *lfa;                // loop-free alternate of d, NO_NODE if none, 0x0 until computed
+    struct tw_timer lfa_due;  // routes have been quiet for DV_LFA_QUIET
+    uint64_t rng;             // periodic jitter
+    bool stop;                // dv_run returns
+    struct lsr *lsr;          // link-state engine, 0x0 when running distance vector
+    unsigned long changes;    // routes changed so far
+    unsigned int damped;      // links whose cost damping holds
+    unsigned int deferred;    // links holding back a triggered update
+    unsigned int coming_up;   // adjacencies whose hello session is not up
+    struct dv_stats stats;
+};
+
+extern struct dv *g_dv;
+
+/* run link state (lsr.c) instead of distance vector, set before dv_init */
+extern bool dv_link_state;
+
+/* distance vector only, 0 turns either off */
+extern unsigned int dv_damp_half_ms;  // half-life of a link's flap penalty
+extern unsigned int dv_trigger_ms;    // least time between triggered updates to a neighbor
+
+/* how an update leaves the router, one iovec per datagram */
+typedef void (*dv_output_fn)(struct link *l, struct iovec *iov, size_t n);
+extern dv_output_fn dv_output;
+void dv_sendmmsg(struct link *l, struct iovec *iov, size_t n); // the default
+
+bool dv_local(struct link *l);  // one end of l is me and the other is not
+node dv_peer(struct link *l);
+void dv_transmit(struct link *l, struct iovec *iov, size_t n); // dv_output, counted
+void dv_route_changed(node d, uint64_t now);
+
+/*
+ * One line per window for scripts to compare, all fields key=value:
+ *   [stats] set=1 node=3 engine=dv settle_ms=40 changes=2 flaps=0 ...
+ * settle_ms is from the start of the window to the last route change,
+ * tx_ and rx_ count routing datagrams only, hellos have their own.
+ * node is "all" for a sum over routers, with settle_ms their maximum.
+ */
+void dv_stats_print(struct dv_stats *st, int set, node who);
+void dv_stats_reset(uint64_t now);  // start a new window
+
+uint64_t dv_now();  // monotonic clock in ms
+void dv_init(unsigned int update_time, unsigned int holddown, int verbose, uint64_t now);
+void dv_sync_links(uint64_t now);  // pick up link changes after an event set
+void dv_del_link(struct link *l);  // before l is torn down
+void dv_ud_link(struct link *l, cost c);  // before l's cost becomes c
+void dv_neighbor_up(struct link *l, uint64_t now);    // bfd.c says so
+void dv_neighbor_down(struct link *l, uint64_t now);
+void dv_input(struct link *l, uint8_t *buf, size_t len, uint64_t now);
+uint64_t dv_timers(uint64_t now);  // run what is due, returns when to call again
+void dv_schedule(struct tw_timer *t, uint64_t when);
+void dv_skip(uint64_t t);
+void dv_run();  // until dv_stop
+void dv_stop();
+
+#endif
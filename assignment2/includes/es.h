@@ -14,21 +14,20 @@
 typedef enum {_es_null=0, _es_link, _ud_link, _td_link} e_type;
 
 struct es{
-    struct es *next;
-    struct es *prev;
-  
     e_type ev;
     int peer0, port0, peer1, port1;
     int cost;
     char *name;
 };
 
-  
+/*
+ * One event set. The events of all sets are kept back to back in one
+ * array, in the order they were parsed; a set owns the events
+ * first .. first + count - 1.
+ */
 struct el{
-  struct el* next;
-  struct el* prev;
-  
-  struct es* es_head;
+    size_t first;
+    size_t count;
 };
 
 
@@ -38,10 +37,16 @@ void add_to_last_es(e_type ev,
 		    node peer0, int port0,
 		    node peer1, int port1,
 		    int cost, char *name);
-void walk_el(int update_time, int time_between_updates, int verbose);
+void walk_el(int update_time, int time_between_updates, int holddown, int verbose);
 void dispatch_event(struct es* es);
 void print_el();
 void print_event(struct es* es);
-struct es *geteventbylink(char *lname);
+bool is_local_link(char *lname);
+cost get_cost_bound();  // every link cost in the scenario added up
+void set_cost_bound(cost c);
+struct el *get_el(size_t *nsets);  // the parsed event sets, in order
+struct es *get_es(struct el *el);  // first event of a set
+void free_el();  // drop every event set at once
+void free_scenario();  // event sets, hosts, links and names, all at once
 
 #endif
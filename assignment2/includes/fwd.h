@@ -0,0 +1,98 @@
+/* $Id$
+ * Data plane: forwarding over the routing table
+ */
+#ifndef _FWD_H_
+#define _FWD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "rt.h"
+
+/*
+ * Data packets share the link sockets with routing:
+ *
+ *   0       1       2       3
+ *   +-------+-------+-------+-------+
+ *   | type  |version|  ttl  |   0   |
+ *   +-------+-------+-------+-------+
+ *   |    destination (network)      |
+ *   +-------------------------------+
+ *   |       flow (network)          |
+ *   +-------------------------------+
+ *   then the payload
+ *
+ * A router delivers a packet for itself and sends any other one on with
+ * the ttl one less. Packets of the same flow take the same next hop.
+ */
+#define FWD_TYPE     0xa
+#define FWD_VERSION  0x1
+#define FWD_HDR      12
+#define FWD_TTL      64
+#define FWD_BATCH    64     // datagrams per recvmmsg
+#define FWD_MAXDGRAM 65536
+
+#define FWD_READERS  16     // threads that may forward at once
+
+/* one destination: the sockets toward its next hops, in table order */
+struct fib_entry {
+    uint32_t n;            // 0 if there is no route
+    int sd[RT_ECMP];       // my end of the link to each hop
+};
+
+/*
+ * A FIB snapshot. Once published it is never written again: routing
+ * builds the next one beside it and swaps the pointer, so a reader sees
+ * one whole table or the other and takes no lock. A snapshot that has
+ * been replaced waits on the retired list until no reader can still
+ * hold it.
+ */
+struct fib {
+    node cap;                  // destinations below cap have an entry
+    unsigned long epoch;       // the epoch it was retired in
+    struct fib *retired;       // next one waiting to be freed
+    struct fib_entry e[];
+};
+
+/*
+ * One router's data plane. Like g_rt there is one per process, swapped
+ * to play many. Readers announce the epoch they entered in, 0 while
+ * they hold nothing; a retired snapshot is freed once every reader has
+ * entered after it was replaced, or left.
+ */
+struct fwd {
+    node me;
+    struct fib *fib;           // current snapshot, read with fib_enter
+    struct fib *next;          // being built, between fib_begin and fib_publish
+    struct fib *retired;
+    unsigned long epoch;
+    unsigned long reader[FWD_READERS];
+    unsigned long changes;     // g_dv->changes it was derived at
+    unsigned long links;       // and ls_gen
+    unsigned long published, reclaimed;
+    unsigned long rx, tx, delivered, no_route, expired;
+};
+
+extern struct fwd *g_fwd;
+extern unsigned int fwd_batch;  // datagrams per call to the kernel, 1 .. FWD_BATCH
+
+/* what is not a data packet goes here, dv_input fits */
+struct link;
+typedef void (*fwd_ctl_fn)(struct link *l, uint8_t *buf, size_t len, uint64_t now);
+
+int create_fwd(node me);
+
+/* control plane: build a whole new table and swap it in */
+void fib_begin(node cap);  // every destination below cap without a route
+void fib_set(node d, int *sd, unsigned int n);
+void fib_publish();
+
+/* data plane, any thread: lookups between enter and exit see one snapshot */
+struct fib *fib_enter();
+void fib_exit();
+int fib_hop(struct fib *f, node d, uint32_t flow);  // -1 if no route
+
+size_t fwd_drain(struct link *l, int sd, fwd_ctl_fn ctl, uint64_t now); // returns datagrams read
+void fwd_print(int set);
+
+#endif
@@ -0,0 +1,26 @@
+/* $Id$
+ * Interned link names
+ */
+
+#ifndef _INTERN_H_
+#define _INTERN_H_
+
+#include "uthash.h"
+
+/*
+ * One record per distinct name. Everything that refers to a link or host
+ * by name shares the record's string, and for a link name the record
+ * indexes the link that carries it. Records live until free_names.
+ */
+struct iname {
+    struct link *link;   // link currently using this name
+    bool local;          // a local event has named this link
+    UT_hash_handle hh;
+    char s[];
+};
+
+char *intern(char *s);
+struct iname *find_iname(char *s);
+void free_names();
+
+#endif
@@ -5,6 +5,10 @@
 #ifndef _LS_H_
 #define _LS_H_
 
+#include <stdint.h>
+#include "tw.h"
+#include "bfd.h"
+
 struct link {
     struct link *next;  // next entry
     struct link *prev;  // prev entry
@@ -14,9 +18,31 @@ struct link {
     int  sockfd1;       // if peer1 is itself, local port is bound
     cost c;		// cost
     char *name;
+    bool adj;           // set up as an adjacency by dv_sync_links
+    bool synced;        // link state: heard from since it came up, and sent our database
+    bool dump;          // link state: send it the whole database next flush
+    cost *vec;          // distance vector: peer's last advertised cost to each node
+    node *prot;         // distance vector: routes through the peer with somewhere else to go
+    size_t nprot, prot_cap;
+    int  mtu;           // largest update datagram toward the peer
+    uint32_t tx_seq;    // last update sent on the link
+    uint32_t rx_seq;    // last update accepted from the peer
+    uint64_t *pend;     // distance vector: changes the peer has not been sent yet
+    uint64_t trig_at;   // and when it may next be sent some
+    struct tw_timer trig;
+    uint32_t pen;       // distance vector: flap penalty of the cost, as of pen_at
+    uint64_t pen_at;
+    bool damped;        // and if so routing takes it to cost held
+    cost held;
+    struct tw_timer reuse;
+    struct tw_timer timeout; // peer not heard from, see dv.c
+    struct bfd bfd;     // liveness of the peer, see bfd.c
 };
 
-struct link *g_ls;
+extern struct link *g_ls;
+extern bool ls_bind_ports;  // bind local ends, the simulator has no sockets
+extern int g_ls_epfd;       // epoll set of every bound socket, data.ptr is its link
+extern unsigned long ls_gen; // bumped whenever a link comes, goes or changes cost
 
 int create_ls();
 int add_link(node peer0, int port0, node peer1, int port1, 
@@ -28,5 +54,7 @@ struct link *find_link(char *n);
 void print_link(struct link* i);
 void print_ls();
 struct link *ud_link(char *n, int cost);
+void free_ls();        // close and drop the current link set
+void release_links();  // free every link, after free_ls on every set
 
 #endif
@@ -0,0 +1,80 @@
+/* $Id$
+ * Link-state routing
+ */
+#ifndef _LSR_H_
+#define _LSR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Flooding wire format, on the same link sockets as distance vector:
+ *
+ *   0       1       2       3
+ *   +-------+-------+-------+-------+
+ *   | type  |version|   0   |   0   |
+ *   +-------+-------+-------+-------+
+ *   then LSAs until the end of the datagram:
+ *   varint(origin), varint(seq), varint(n), n times varint(gap), varint(cost)
+ *
+ * An LSA lists the origin's neighbors in increasing id order, gap being
+ * how many ids were skipped since the previous one, as in dv.h. An LSA
+ * that does not fit the MTU gets a datagram of its own.
+ */
+#define LSR_TYPE    0x8
+#define LSR_VERSION 0x1
+#define LSR_HDR     4
+#define LSR_D       4      // arity of the SPF heap
+
+struct link;
+
+/* the latest LSA of one origin, its row of the edge arrays */
+struct lsa {
+    uint32_t seq;          // 0 if never heard of
+    uint32_t n;            // neighbors listed
+    uint32_t off;          // where the row starts in to[] and c[]
+    uint32_t room;         // slots the row may grow into
+};
+
+/* an edge that appeared or got cheaper, to be relaxed by the next SPF run */
+struct lsr_seed {
+    node u, v;
+};
+
+/*
+ * Link-state database and shortest-path tree of one router. Rows of
+ * the database are packed back to back in two arrays, compressed sparse
+ * row style with a little slack, so SPF streams through them.
+ */
+struct lsr {
+    node cap;
+    struct lsa *db;        // by origin
+    node *to;              // edge targets
+    cost *c;               // edge costs
+    size_t edges, edges_cap, holes;
+    cost *dist;            // shortest path tree: distance from me
+    node *parent;
+    node *hop;             // first hops toward each node, paths slots per node
+    uint8_t *nhop;         // how many of them are in use
+    unsigned int paths;    // rt_max_paths when the router came up
+    struct lsr_seed *seeds;
+    size_t nseeds, seeds_cap;
+    bool full;             // a tree edge got worse, rerun from scratch
+    bool spf;              // run SPF at the next flush
+    node *fq;              // origins to flood, in arrival order
+    struct link **fq_from; // and where each came from (not sent back there)
+    size_t fq_len, fq_cap;
+    uint64_t *queued;      // bit set if the origin is in fq
+    unsigned long runs, full_runs;
+};
+
+struct lsr *lsr_init();
+void lsr_neighbor_up(struct link *l);
+void lsr_neighbor_down(struct link *l);
+void lsr_originate();  // my LSA from the current adjacencies, flooded if it changed
+bool lsr_input(struct link *l, uint8_t *buf, size_t len); // false if not ours
+void lsr_hello();      // my LSA to every neighbor, proof of life
+void lsr_flush(uint64_t now); // flood what is queued, then rerun SPF
+
+#endif
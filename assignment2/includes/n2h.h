@@ -5,24 +5,33 @@
 #ifndef _N2H_H_
 #define _N2H_H_
 
+#include <netinet/in.h>
+
 struct n2h {
     struct n2h *next;
     struct n2h *prev;
     node nid;    // node id
     char *hostname;  // hostname
+    struct in_addr addr; // filled in once by resolve_n2h
+    bool local;  // addr is my own
 };
 
 // interface
 char *gethostbynode(node nid);
+struct in_addr *getaddrbynode(node nid);
 int  bind_port(int port);
 
 // internal
 int create_n2h();
 int add_n2h(node nid, char *hostname);
+void resolve_n2h();
+void free_n2h();
 void print_n2h();
 node get_myid();
 void set_myid (node myid);
 int init_rt_from_n2h();
 bool is_me(node nid); // is nid on my machine?
+void check_myid();
+node next_n2h(node prev);
 
 #endif
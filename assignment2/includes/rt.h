@@ -4,22 +4,87 @@
 #ifndef _RT_H_
 #define _RT_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define RT_ECMP 4  // most equal-cost next hops a route can have
+#define RT_MAX_NODE (1u << 31)  // node ids from here on are refused
+
+/* one route, as handed out by find_rte */
 struct rte{
-    struct rte *next;  // next entry
-    struct rte *prev;  // prev entry
     node d;  // dest
     cost c;  // cost
     node nh; // next hop
+    unsigned int paths;      // next hops, nh and then alt
+    node alt[RT_ECMP - 1];
+};
+
+/*
+ * Dense table indexed by destination node id. Costs and next hops are
+ * kept in separate arrays so a relaxation pass streams through exactly
+ * the data it needs; a bitmap says which ids have a route at all.
+ */
+struct rt{
+    node cap;          // ids below cap have a slot
+    node n;            // number of valid entries
+    cost *c;           // cost[d]
+    node *nh;          // nexthop[d]
+    uint64_t *valid;   // bit d set if d has a route
+    uint8_t *paths;    // next hops of d, 0x0 if only ever one
+    node *alt;         // the ones after nh, RT_ECMP - 1 slots per d
 };
 
-struct rte* g_rt;
+extern struct rt *g_rt;
+extern unsigned int rt_max_paths;  // 1 .. RT_ECMP, set before create_rt
+
+#define rt_valid(rt, d) \
+    ((d) < (rt)->cap && ((rt)->valid[(d) >> 6] >> ((d) & 63) & 1))
 
 int create_rt();
+void free_rt();  // g_rt and everything in it
 int add_rte(node n, cost c, node nh);
 int update_rte(node n, cost c, node nh);
 int del_rte(node n);
-struct rte *find_rte(node n);
-void print_rte(struct rte* i);
+/*
+ * A copy of n's route in one static entry, 0x0 if there is none. The
+ * next call overwrites it, and it is not the table: change a route with
+ * update_rte.
+ */
+const struct rte *find_rte(node n);
+node next_rte(node prev);
+
+/* equal-cost multipath: nh[0] becomes the next hop, the rest alternates */
+#define rte_npaths(rt, d) ((rt)->paths ? (rt)->paths[d] : 1u)
+#define rte_hop(rt, d, k) \
+    ((k) ? (rt)->alt[(size_t)(d) * (RT_ECMP - 1) + (k) - 1] : (rt)->nh[d])
+int update_rte_paths(node n, cost c, node *nh, unsigned int k);
+bool same_rte_paths(node n, cost c, node *nh, unsigned int k);
+bool add_rte_hop(node n, node hop);     // false if it is one or no room
+bool rte_via(node n, node hop);         // hop is one of n's next hops
+node pick_rte(node n, uint32_t flow);   // the next hop for a flow
+void print_rte(const struct rte* i);
+
+/*
+ * Relax destinations lo .. hi - 1 through a neighbor that is lc away
+ * and advertised vec: c[d] = min(c[d], lc + vec[d]), nh[d] = via where
+ * that is strictly cheaper. Sums that wrap or reach inf never win. Sets
+ * bit d of changed for each entry that moved and returns how many did;
+ * their paths are the caller's to reset. Bit d of ties, if given, is
+ * set where via would be an equally cheap next hop other than nh[d].
+ * Invalid slots are relaxed like any other, keep vec unreachable there.
+ */
+size_t rt_relax(const cost *vec, cost lc, node via, cost inf, node lo, node hi,
+	uint64_t *changed, uint64_t *ties);
+
+/* the kernels behind rt_relax, best first, for bench.c */
+typedef size_t (*rt_relax_fn)(cost *c, node *nh, const cost *vec, cost lc,
+	node via, cost inf, node lo, node hi, uint64_t *changed, uint64_t *ties);
+struct rt_kernel {
+    const char *name;
+    rt_relax_fn fn;
+};
+extern struct rt_kernel rt_kernels[];  // ends with a 0x0 name
+bool rt_kernel_ok(struct rt_kernel *k); // this CPU can run it
 void print_rt();
 
 #endif
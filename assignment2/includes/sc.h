@@ -0,0 +1,66 @@
+/* $Id$
+ * Compiled scenario image
+ */
+#ifndef _SC_H_
+#define _SC_H_
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * A parsed scenario as one flat file that is mapped, not read:
+ *
+ *   header | nodes[] | sets[] | events[] | strings
+ *
+ * Hostnames and link names are offsets into the string table, where each
+ * distinct string is stored once, NUL terminated. Set i owns events
+ * first .. first + count - 1. Fields are in host byte order, an image is
+ * only meant for the machines it was compiled for.
+ */
+#define SC_MAGIC   "RUSCENE"
+#define SC_VERSION 1
+
+struct sc_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t nnodes;
+    uint32_t nsets;
+    uint32_t nevents;
+    uint64_t nodes_off;
+    uint64_t sets_off;
+    uint64_t events_off;
+    uint64_t strings_off;
+    uint64_t strings_len;
+    uint32_t cost_bound;   // get_cost_bound() of the whole scenario
+    uint32_t pad;
+};
+
+struct sc_node {
+    uint32_t id;
+    uint32_t host;
+};
+
+struct sc_set {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct sc_event {
+    uint8_t ev;            // e_type
+    uint8_t pad[3];
+    uint32_t peer0, port0, peer1, port1;
+    uint32_t cost;
+    uint32_t name;
+};
+
+extern struct sc_hdr *g_sc;  // mapped image, 0x0 if the scenario was parsed
+
+bool sc_is_image(char *fname);
+void sc_compile(char *fname);  // write what the parser read
+void sc_load(char *fname);     // map an image and set up n2h from it
+
+#define sc_sets(h)   ((struct sc_set *)((char *)(h) + (h)->sets_off))
+#define sc_events(h) ((struct sc_event *)((char *)(h) + (h)->events_off))
+#define sc_str(h, o) ((char *)(h) + (h)->strings_off + (o))
+
+#endif
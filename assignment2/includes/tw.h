@@ -0,0 +1,59 @@
+/* $Id$
+ * Hierarchical timing wheel, after the one in assignment1
+ */
+#ifndef _TW_H_
+#define _TW_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 3  // 64^3 ticks, about 4.4 minutes at millisecond resolution
+#define TW_NEVER UINT64_MAX
+
+struct tw_timer;
+typedef void (*tw_expire_fn)(struct tw_timer *t, uint64_t now);
+
+/*
+ * A timer embedded in whatever structure needs to expire, and what to
+ * call when it does. A timer is pending while next is non-NULL.
+ */
+struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer *prev;
+    uint64_t expires;
+    tw_expire_fn fn;
+    uint8_t level;
+    uint8_t slot;
+};
+
+/* the structure a timer is embedded in */
+#define tw_entry(t, type, member) \
+    ((type *)((char *)(t) - offsetof(type, member)))
+
+/*
+ * Level 0 holds timers due within the next 64 ticks, and each higher
+ * level covers 64 times the span of the one below it. Timers in a higher
+ * level slot are cascaded down when the wheel reaches the start of that
+ * slot. Deadlines past the last level are parked in its last slot and
+ * placed again when they cascade.
+ */
+struct timerwheel {
+    uint64_t now;                 // last tick that was processed
+    uint64_t occupied[TW_LEVELS]; // bitmap of non-empty slots per level
+    size_t count;
+    struct tw_timer slots[TW_LEVELS][TW_SIZE];
+};
+
+void tw_init(struct timerwheel *tw, uint64_t now);
+void tw_add(struct timerwheel *tw, struct tw_timer *t, uint64_t expires); // t must not be pending
+void tw_del(struct timerwheel *tw, struct tw_timer *t); // no-op if t is not pending
+void tw_mod(struct timerwheel *tw, struct tw_timer *t, uint64_t expires);
+size_t tw_advance(struct timerwheel *tw, uint64_t now); // fire what is due, returns how many
+uint64_t tw_next(struct timerwheel *tw); // when tw_advance has work next, TW_NEVER if empty
+
+#define tw_pending(t) ((t)->next != 0x0)
+
+#endif
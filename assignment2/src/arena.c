@@ -0,0 +1,71 @@
+/* $Id$
+ * Region allocator
+ */
+#ifndef _ARENA_C_
+#define _ARENA_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "queue.h"
+#include "arena.h"
+
+#define CHUNK_MIN (64 << 10)
+#define CHUNK_MAX (64 << 20)
+
+struct chunk {
+	struct chunk *prev;
+	char pad[ARENA_ALIGN - sizeof(struct chunk *)];
+	char mem[];
+};
+
+/* start a chunk that fits at least <size> bytes */
+static void arena_grow(struct arena *a, size_t size) {
+	size_t len = a->next ? a->next : CHUNK_MIN;
+	struct chunk *c;
+
+	if (len < size)
+		len = size;
+	c = (struct chunk *) getmem (sizeof(struct chunk) + len);
+	if (!c) {
+		perror("arena: malloc failed");
+		exit(1);
+	}
+	c->prev = a->chunk;
+	a->chunk = c;
+	a->cur = c->mem;
+	a->end = c->mem + len;
+	if (a->next < CHUNK_MAX)
+		a->next = a->next ? a->next * 2 : CHUNK_MIN * 2;
+}
+
+/*
+ * <size> bytes aligned for anything, never freed on their own
+ */
+void *arena_alloc(struct arena *a, size_t size) {
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > (size_t)(a->end - a->cur))
+		arena_grow(a, size);
+	p = a->cur;
+	a->cur += size;
+	return p;
+}
+
+/*
+ * Release everything allocated from <a>, which can be reused afterwards
+ */
+void arena_free(struct arena *a) {
+	struct chunk *c, *prev;
+
+	for (c = a->chunk; c; c = prev) {
+		prev = c->prev;
+		free(c);
+	}
+	memset(a, 0, sizeof(struct arena));
+}
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * Microbenchmarks for the routing modules
+ *   bench rt [ops]      lookups and updates at 10, 1k and 100k nodes
+ *   bench relax [ops]   min-plus relaxation of a 100k vector, per kernel
+ *   bench fwd [packets] data packets through a chain of routers, per batch size
+ *   bench fib [ops]     FIB lookups from several threads while routing republishes
+ */
+#define _GNU_SOURCE  // sendmmsg
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "rt.h"
+#include "fwd.h"
+
+static unsigned long long rng = 88172645463325252ULL;
+
+static unsigned long long xorshift() {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_rt(long ops) {
+	node sizes[] = { 10, 1000, 100000 };
+	unsigned long long sum = 0;
+
+	for (int s = 0; s < 3; s++) {
+		node n = sizes[s], d;
+		double t0, t1, t2;
+		long i;
+
+		create_rt();
+		for (d = 0; d < n; d++)
+			add_rte(d, INF_COST, d);
+
+		t0 = now_sec();
+		for (i = 0; i < ops; i++) {
+			const struct rte *e = find_rte(xorshift() % n);
+			sum += e->c;
+		}
+		t1 = now_sec();
+		for (i = 0; i < ops; i++) {
+			d = xorshift() % n;
+			update_rte(d, i, (d + 1) % n);
+		}
+		t2 = now_sec();
+		printf("rt nodes %u ops %ld lookup %.1f ns/op update %.1f ns/op\n",
+			n, ops, (t1 - t0) * 1e9 / ops, (t2 - t1) * 1e9 / ops);
+		free_rt();
+	}
+	if (sum == 42)
+		puts(""); // keep the lookups from being optimized away
+}
+
+/*
+ * One neighbor's vector against the table, every kernel and then
+ * route by route through find_rte/update_rte as a baseline. Quiet is a
+ * vector with no news, busy one that improves about half the routes;
+ * the table is restored before each busy pass, and that copy is timed
+ * on its own and taken off.
+ */
+static void bench_relax(long ops) {
+	node n = 100000, d;
+	cost *vec = (cost *) malloc (n * sizeof(cost));
+	cost *c0 = (cost *) malloc (n * sizeof(cost));
+	node *nh0 = (node *) malloc (n * sizeof(node));
+	uint64_t *changed = (uint64_t *) calloc (n / 64 + 1, sizeof(uint64_t));
+	struct rt_kernel *k;
+	long rounds = ops / n > 0 ? ops / n : 1, r;
+	double t0, copy;
+	size_t moved = 0;
+
+	create_rt();
+	for (d = 0; d < n; d++) {
+		add_rte(d, 1000 + xorshift() % 1000, d);
+		c0[d] = g_rt->c[d];
+		nh0[d] = d;
+		vec[d] = 1000 + xorshift() % 1000;
+	}
+	t0 = now_sec();
+	for (r = 0; r < rounds; r++) {
+		memcpy(g_rt->c, c0, n * sizeof(cost));
+		memcpy(g_rt->nh, nh0, n * sizeof(node));
+	}
+	copy = now_sec() - t0;
+
+	for (k = rt_kernels; ; k++) {
+		double quiet, busy;
+		bool api = !k->name;
+
+		if (!api && !rt_kernel_ok(k))
+			continue;
+		t0 = now_sec();
+		for (r = 0; r < rounds; r++) {
+			memcpy(g_rt->c, c0, n * sizeof(cost));
+			memcpy(g_rt->nh, nh0, n * sizeof(node));
+			if (api) {
+				for (d = 0; d < n; d++) {
+					const struct rte *e = find_rte(d);
+
+					if (vec[d] + 10 < e->c)
+						update_rte(d, vec[d] + 10, n);
+				}
+			} else {
+				moved += k->fn(g_rt->c, g_rt->nh, vec, 10, n, INF_COST, 0, n, changed, 0x0);
+			}
+		}
+		busy = now_sec() - t0 - copy;
+		// now everything is as cheap as vec makes it
+		t0 = now_sec();
+		for (r = 0; r < rounds; r++) {
+			if (api) {
+				for (d = 0; d < n; d++) {
+					const struct rte *e = find_rte(d);
+
+					if (vec[d] + 10 < e->c)
+						update_rte(d, vec[d] + 10, n);
+				}
+			} else {
+				moved += k->fn(g_rt->c, g_rt->nh, vec, 10, n, INF_COST, 0, n, changed, 0x0);
+			}
+		}
+		quiet = now_sec() - t0;
+		printf("relax %-7s entries %u rounds %ld quiet %.2f ns/entry busy %.2f ns/entry\n",
+			api ? "rte" : k->name, n, rounds, quiet * 1e9 / rounds / n,
+			busy * 1e9 / rounds / n);
+		if (api)
+			break;
+	}
+	if (moved == 42)
+		puts("");
+	free(vec);
+	free(c0);
+	free(nh0);
+	free(changed);
+	free_rt();
+}
+
+#define FWD_HOPS  4    // routers in the chain
+#define FWD_BURST 128  // packets the source sends between drains
+
+/* a non-blocking UDP socket on loopback, connected to port if it is not 0 */
+static int bench_sock(int port, int *bound) {
+	struct sockaddr_in a;
+	socklen_t len = sizeof(a);
+	int sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0), buf = 1 << 22;
+
+	if (sd < 0) {
+		perror("socket() failed");
+		exit(1);
+	}
+	setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+		perror("bind() failed");
+		exit(1);
+	}
+	getsockname(sd, (struct sockaddr *)&a, &len);
+	*bound = ntohs(a.sin_port);
+	if (port) {
+		a.sin_port = htons(port);
+		if (connect(sd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+			perror("connect() failed");
+			exit(1);
+		}
+	}
+	return sd;
+}
+
+/*
+ * A source sends bursts down a chain of FWD_HOPS routers, each with its
+ * own FIB, and every router drains its socket in turn. The packets cross
+ * the kernel on every hop, so this is the cost of a hop as rt pays it,
+ * once with a datagram per system call and once with FWD_BATCH.
+ */
+static void bench_fwd(long packets) {
+	unsigned int batches[] = { 1, FWD_BATCH };
+	struct fwd *r[FWD_HOPS];
+	int in[FWD_HOPS], out[FWD_HOPS], port[FWD_HOPS], src, i, b;
+	struct mmsghdr msgs[FWD_BURST];
+	struct iovec iov[FWD_BURST];
+	uint8_t pkt[FWD_BURST][FWD_HDR + 64];
+
+	for (i = 0; i < FWD_HOPS; i++)
+		in[i] = bench_sock(0, &port[i]);
+	for (i = 0; i < FWD_HOPS; i++) {
+		int sd, unused;
+
+		create_fwd(i);  // the last one is the destination
+		r[i] = g_fwd;
+		if (i < FWD_HOPS - 1) {
+			sd = out[i] = bench_sock(port[i + 1], &unused);
+			fib_begin(FWD_HOPS);
+			fib_set(FWD_HOPS - 1, &sd, 1);
+			fib_publish();
+		}
+	}
+	src = bench_sock(port[0], &i);
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < FWD_BURST; i++) {
+		uint32_t dst = htonl(FWD_HOPS - 1), flow = htonl(i);
+
+		memset(pkt[i], 0, sizeof(pkt[i]));
+		pkt[i][0] = FWD_TYPE;
+		pkt[i][1] = FWD_VERSION;
+		pkt[i][2] = FWD_TTL;
+		memcpy(pkt[i] + 4, &dst, 4);
+		memcpy(pkt[i] + 8, &flow, 4);
+		iov[i].iov_base = pkt[i];
+		iov[i].iov_len = sizeof(pkt[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (b = 0; b < 2; b++) {
+		long sent = 0;
+		double t0, t;
+
+		fwd_batch = batches[b];
+		for (i = 0; i < FWD_HOPS; i++) {
+			r[i]->rx = r[i]->tx = r[i]->delivered = 0;
+			r[i]->no_route = r[i]->expired = 0;
+		}
+		t0 = now_sec();
+		while (sent < packets) {
+			int k = sendmmsg(src, msgs, FWD_BURST, 0);
+
+			if (k > 0)
+				sent += k;
+			for (i = 0; i < FWD_HOPS; i++) {
+				g_fwd = r[i];
+				fwd_drain(0x0, in[i], 0x0, 0);
+			}
+		}
+		t = now_sec() - t0;
+		printf("fwd batch %-3u routers %d sent %ld delivered %lu %.0f pps %.1f ns/router\n",
+			fwd_batch, FWD_HOPS, sent, r[FWD_HOPS - 1]->delivered,
+			r[FWD_HOPS - 1]->delivered / t,
+			r[FWD_HOPS - 1]->delivered ? t * 1e9 / r[FWD_HOPS - 1]->delivered / FWD_HOPS : 0);
+	}
+	for (i = 0; i < FWD_HOPS; i++) {
+		close(in[i]);
+		if (i < FWD_HOPS - 1)
+			close(out[i]);
+	}
+	close(src);
+}
+
+#define FIB_THREADS 3
+#define FIB_NODES   100000
+
+static long fib_ops;
+static int fib_writing;
+
+/*
+ * Every snapshot the writer publishes sends all destinations to the
+ * same socket number, a new one each time, so a reader that sees two
+ * numbers inside one enter/exit has seen a half-built table.
+ */
+static void *fib_reader(void *arg) {
+	unsigned long long x = 0x9e3779b97f4a7c15ULL * ((long)arg + 1);
+	long i = 0, bad = 0;
+
+	while (i < fib_ops) {
+		struct fib *f = fib_enter();
+		int first = -1, j;
+
+		for (j = 0; j < 64; j++, i++) {
+			int sd;
+
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			sd = fib_hop(f, x % FIB_NODES, (uint32_t)x);
+			if (first < 0)
+				first = sd;
+			else if (sd != first)
+				bad++;
+		}
+		fib_exit();
+	}
+	return (void *) bad;
+}
+
+static void fib_build(int gen) {
+	int sd[RT_ECMP] = { gen, gen, gen, gen };
+	node d;
+
+	fib_begin(FIB_NODES);
+	for (d = 0; d < FIB_NODES; d++)
+		fib_set(d, sd, 1 + d % RT_ECMP);
+	fib_publish();
+}
+
+static void *fib_writer(void *arg) {
+	int gen = 1;
+
+	UNUSED(arg);
+	while (__atomic_load_n(&fib_writing, __ATOMIC_RELAXED))
+		fib_build(++gen);
+	return 0x0;
+}
+
+/*
+ * FIB_THREADS threads look up random destinations in a 100k-entry FIB,
+ * first with routing idle and then while another thread republishes
+ * the whole table as fast as it can.
+ */
+static void bench_fib(long ops) {
+	pthread_t r[FIB_THREADS], w;
+	long t, torn;
+	int busy;
+
+	create_fwd(0);
+	fib_build(1);
+	fib_ops = ops;
+	for (busy = 0; busy < 2; busy++) {
+		unsigned long published = g_fwd->published;
+		double t0, el;
+
+		torn = 0;
+		__atomic_store_n(&fib_writing, busy, __ATOMIC_RELAXED);
+		if (busy)
+			pthread_create(&w, 0x0, fib_writer, 0x0);
+		t0 = now_sec();
+		for (t = 0; t < FIB_THREADS; t++)
+			pthread_create(&r[t], 0x0, fib_reader, (void *) t);
+		for (t = 0; t < FIB_THREADS; t++) {
+			void *bad;
+
+			pthread_join(r[t], &bad);
+			torn += (long) bad;
+		}
+		el = now_sec() - t0;
+		__atomic_store_n(&fib_writing, 0, __ATOMIC_RELAXED);
+		if (busy)
+			pthread_join(w, 0x0);
+		printf("fib %-4s threads %d entries %d lookup %.2f ns/op published %lu "
+			"reclaimed %lu torn %ld\n", busy ? "busy" : "idle", FIB_THREADS,
+			FIB_NODES, el * 1e9 / ops, g_fwd->published - published,
+			g_fwd->reclaimed, torn);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	long ops = 1000000;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s rt|relax|fwd|fib [ops]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		ops = atol(argv[2]);
+	if (!strcmp(argv[1], "rt")) {
+		bench_rt(ops);
+	} else if (!strcmp(argv[1], "relax")) {
+		bench_relax(ops * 100);
+	} else if (!strcmp(argv[1], "fwd")) {
+		bench_fwd(ops);
+	} else if (!strcmp(argv[1], "fib")) {
+		bench_fib(ops * 10);
+	} else {
+		fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
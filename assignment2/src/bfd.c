@@ -0,0 +1,152 @@
+/* $Id$
+ * Neighbor liveness, after BFD (RFC 5880)
+ *
+ * Every adjacency sends a hello each bfd_interval ms, less up to a
+ * quarter so neighbors do not fall into step, from a timer on the
+ * router's wheel. A session that changes state says so right away
+ * instead of waiting for the next hello. Routing hears of it through
+ * dv_neighbor_up and dv_neighbor_down, and does not listen to a
+ * neighbor whose session is not up.
+ */
+#ifndef _BFD_C_
+#define _BFD_C_
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "bfd.h"
+#include "dv.h"
+#include "ls.h"
+
+unsigned int bfd_interval = 0;
+unsigned int bfd_mult = 3;
+
+static uint64_t bfd_rng = 0x2545f4914f6cdd1dULL;
+static const char *bfd_state_name[] = { "admin down", "down", "init", "up" };
+
+static uint64_t bfd_next() {
+	uint64_t x = bfd_rng;
+	unsigned int span = bfd_interval / 4;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	bfd_rng = x;
+	return bfd_interval - (span ? x % (span + 1) : 0);
+}
+
+static void bfd_send(struct link *l) {
+	uint8_t buf[BFD_LEN];
+	uint32_t iv = htonl(bfd_interval);
+	struct iovec iov;
+
+	buf[0] = BFD_TYPE;
+	buf[1] = BFD_VERSION;
+	buf[2] = l->bfd.state;
+	buf[3] = bfd_mult;
+	memcpy(buf + 4, &iv, 4);
+	iov.iov_base = buf;
+	iov.iov_len = BFD_LEN;
+	g_dv->stats.hello_tx++;  // not in tx_msgs, that is routing's
+	dv_output(l, &iov, 1);
+}
+
+static void bfd_set(struct link *l, uint8_t state, uint64_t now) {
+	uint8_t was = l->bfd.state;
+
+	if (state == was)
+		return;
+	l->bfd.state = state;
+	if (state == BFD_DOWN)
+		tw_del(&g_dv->tw, &l->bfd.detect);
+	if (g_dv->verbose)
+		printf("[bfd]\t node(%u) on %s is %s\n", dv_peer(l), l->name,
+			bfd_state_name[state]);
+	bfd_send(l);
+	if (state == BFD_UP) {
+		g_dv->coming_up--;
+		dv_neighbor_up(l, now);
+	} else if (was == BFD_UP) {
+		g_dv->coming_up++;
+		dv_neighbor_down(l, now);
+	}
+}
+
+static void bfd_hello(struct tw_timer *t, uint64_t now) {
+	struct link *l = tw_entry(t, struct link, bfd.tx);
+
+	bfd_send(l);
+	tw_add(&g_dv->tw, t, now + bfd_next());
+}
+
+static void bfd_expire(struct tw_timer *t, uint64_t now) {
+	struct link *l = tw_entry(t, struct link, bfd.detect);
+
+	if (g_dv->verbose)
+		printf("[bfd]\t nothing from node(%u) on %s for %u ms\n", dv_peer(l),
+			l->name, l->bfd.rmult * l->bfd.rint);
+	bfd_set(l, BFD_DOWN, now);
+}
+
+void bfd_start(struct link *l, uint64_t now) {
+	if (!bfd_interval)
+		return;
+	memset(&l->bfd, 0, sizeof(struct bfd));
+	l->bfd.state = BFD_DOWN;
+	g_dv->coming_up++;
+	l->bfd.tx.fn = bfd_hello;
+	l->bfd.detect.fn = bfd_expire;
+	tw_add(&g_dv->tw, &l->bfd.tx, now);
+}
+
+void bfd_stop(struct link *l) {
+	tw_del(&g_dv->tw, &l->bfd.tx);
+	tw_del(&g_dv->tw, &l->bfd.detect);
+}
+
+void bfd_resume(struct link *l, uint64_t t) {
+	if (!bfd_interval)
+		return;
+	tw_add(&g_dv->tw, &l->bfd.tx, t + bfd_next());
+	if (l->bfd.state != BFD_DOWN)
+		tw_add(&g_dv->tw, &l->bfd.detect, t + (uint64_t)l->bfd.rmult * l->bfd.rint);
+}
+
+bool bfd_input(struct link *l, uint8_t *buf, size_t len, uint64_t now) {
+	uint8_t peer;
+	uint32_t iv;
+
+	if (len < BFD_LEN || buf[0] != BFD_TYPE)
+		return false;
+	if (!bfd_interval || buf[1] != BFD_VERSION || !buf[3])
+		return true;
+	memcpy(&iv, buf + 4, 4);
+	l->bfd.rmult = buf[3];
+	l->bfd.rint = ntohl(iv) ? ntohl(iv) : 1;
+
+	peer = buf[2];
+	switch (l->bfd.state) {
+	case BFD_DOWN:
+		if (peer == BFD_DOWN)
+			bfd_set(l, BFD_INIT, now);
+		else if (peer == BFD_INIT)
+			bfd_set(l, BFD_UP, now);
+		break;
+	case BFD_INIT:
+		if (peer == BFD_INIT || peer == BFD_UP)
+			bfd_set(l, BFD_UP, now);
+		break;
+	case BFD_UP:
+		if (peer == BFD_DOWN)
+			bfd_set(l, BFD_DOWN, now);
+		break;
+	}
+	if (l->bfd.state != BFD_DOWN)
+		tw_mod(&g_dv->tw, &l->bfd.detect, now + (uint64_t)l->bfd.rmult * l->bfd.rint);
+	return true;
+}
+
+#endif
@@ -3,24 +3,29 @@
 #include <unistd.h>
 #include <assert.h>
 #include <unistd.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "bfd.h"
+#include "dv.h"
 #include "es.h"
 #include "n2h.h"
+#include "rt.h"
+#include "sc.h"
 
-long alloc_read (char **s, char *fname);
 void usage(char *err_msg, char* name);
 int  parse_arg(int argc, char **argv);
 void parser_init(char *sc_file);
-void ru_scan_string (char *sc);
 
 char *sc_file;
+char *image_file; // compile the scenario into this and exit
 extern int ruparse();
 
 unsigned int update_time = 3;
 unsigned int time_between_sets = 30;
+unsigned int holddown = 500; // ms
 unsigned int verbose = 0;
 //FILE *ConfigFile;
 
@@ -28,50 +33,24 @@ int main(int argc, char *argv[]) {
 	/* check cmd-line arguments, will exit on any error */
 	parse_arg(argc, argv);
 
-	parser_init(sc_file);
-	ruparse();
-
-	walk_el(update_time, time_between_sets, verbose);
-	return 0;
-}
-
-long alloc_read(char **s, char *fname) {
-	int fd = -1;
-	struct stat sbuf;
-	char *fin;
-  
-	fd = open(fname, O_RDONLY);
-	if (fd < 0){
-		fprintf(stderr, "alloc-read: open failure\n");
-		exit(1);
+	if (sc_is_image(sc_file)) {
+		if (image_file)
+			usage("scenario is already compiled", argv[0]);
+		sc_load(sc_file);
+	} else {
+		parser_init(sc_file);
+		ruparse();
 	}
-	fstat (fd, &sbuf);
-  
-	fin = (char *) malloc (sbuf.st_size+1);
-	if (!fin) {
-		fprintf(stderr, "alloc-read: malloc failure\n");
-		exit(1);
+	if (image_file) {
+		sc_compile(image_file);
+		free_scenario();
+		return 0;
 	}
-	if (fd) {
-		read (fd, fin, sbuf.st_size);
-		close (fd);
-	}
-	fin[sbuf.st_size]=0x0;
-	*s = fin;
-	return sbuf.st_size;
-}
- 
-void parser_init(char *sc_file) {
-	char *sc;
 
-	alloc_read(&sc, sc_file);
-	// puts contents of sc_file in string sc
-	ru_scan_string(sc);
-	//yy_scan_string (sc);
-	// parser is set to parse from sc
+	walk_el(update_time, time_between_sets, holddown, verbose);
+	return 0;
 }
 
-
 /*[]------------------------------------------------------------------[]
   [] dr -n <my_node_id> -f <config_file>
   []------------------------------------------------------------------[]*/ 
@@ -85,7 +64,7 @@ int parse_arg(int argc, char **argv) {
 
 	/* to turn off default report of illegal option, uncomment the next line */
 	/* opterr = 0; */
-	while ((opt_char = getopt(argc, argv, "n:f:u:t:v")) != EOF) {
+	while ((opt_char = getopt(argc, argv, "n:f:u:t:H:C:m:E:b:d:D:T:v")) != EOF) {
 		switch (opt_char) {
 			case 'n':
 				set_myid (atoi(optarg));
@@ -101,6 +80,37 @@ int parse_arg(int argc, char **argv) {
 			case 't':
 				time_between_sets = atoi(optarg); 
 				break;
+			case 'H':
+				holddown = atoi(optarg); 
+				break;
+			case 'C':
+				image_file = optarg;
+				break;
+			case 'm':
+				if (!strcmp(optarg, "ls"))
+					dv_link_state = true;
+				else if (strcmp(optarg, "dv"))
+					usage("mode is dv or ls", argv[0]);
+				break;
+			case 'E':
+				rt_max_paths = atoi(optarg);
+				if (rt_max_paths < 1 || rt_max_paths > RT_ECMP)
+					usage("paths out of range", argv[0]);
+				break;
+			case 'b':
+				bfd_interval = atoi(optarg);
+				break;
+			case 'd':
+				bfd_mult = atoi(optarg);
+				if (bfd_mult < 1 || bfd_mult > 255)
+					usage("detect multiplier out of range", argv[0]);
+				break;
+			case 'D':
+				dv_damp_half_ms = atoi(optarg);
+				break;
+			case 'T':
+				dv_trigger_ms = atoi(optarg);
+				break;
 			case 'v':
 				//verbose = atoi(optarg); 
 				verbose = 1; 
@@ -113,7 +123,10 @@ int parse_arg(int argc, char **argv) {
 	if (optind != argc)
 		usage("", argv[0]);
 
-	if (!got_myid)
+	// an image holds every node's events, so it is compiled as nobody
+	if (image_file)
+		set_myid(NO_NODE);
+	else if (!got_myid)
 		usage("", argv[0]);
 
 	if (!got_config)
@@ -128,7 +141,8 @@ int parse_arg(int argc, char **argv) {
 /*[]------------------------------------------------------------------[]
   []------------------------------------------------------------------[]*/ 
 void usage(char *err_msg, char *name) {
-	fprintf(stderr, "\n%s\nUsage: %s -n <my_node_id> [-f <config_file>] [-u update_time] [-t time_between_updates] [-v]\n",
-		err_msg, name);
+	fprintf(stderr, "\n%s\nUsage: %s -n <my_node_id> [-f <config_file|image>] [-u update_time] [-t time_between_updates] [-H holddown_ms] [-m dv|ls] [-E paths] [-b hello_ms] [-d detect_mult] [-D damp_half_life_ms] [-T trigger_ms] [-v]\n"
+		"       %s -C <image> [-f <config_file>]\n",
+		err_msg, name, name);
 	exit(1);
 }
@@ -0,0 +1,1163 @@
+/* $Id$
+ * Distance Vector routing
+ *
+ * Every link with a local end is an adjacency. The vector its peer last
+ * advertised is kept on the link, so a route can be recomputed from
+ * scratch whenever one of its inputs changes instead of trusting
+ * whatever happened to arrive last:
+ *
+ *   cost(d) = min over links l of l->c + l->vec[d]
+ *
+ * Routes through a neighbor are advertised back to it as unreachable
+ * (split horizon with poisoned reverse). A route that gets worse is held
+ * down: until the hold-down expires only a path cheaper than the one that
+ * was lost may replace it, which keeps stale vectors from longer loops
+ * from being believed. Costs are capped at the sum of every link in the
+ * scenario, since no loop-free path can cost more than that, so any
+ * count to infinity that slips through is short.
+ *
+ * As in RIP, full updates are jittered by up to a sixth of the period so
+ * neighbors do not fall into step, a neighbor that stays silent for
+ * DV_TIMEOUT periods is taken to be gone, and an unreachable route is
+ * left out of full updates once it has been advertised for DV_GC of
+ * them. Vectors start out unreachable, so leaving it out tells nobody
+ * anything new.
+ *
+ * Once routes have been quiet for DV_LFA_QUIET ms each one gets a loop-
+ * free alternate: a neighbor other than its next hops that is strictly
+ * closer to the destination than we are, so its path cannot lead back
+ * through us. When a link is torn down or gets dearer, the routes it
+ * carried move to their alternates right away and are held down from
+ * there, instead of going unreachable until the hold-down runs out.
+ *
+ * Two knobs keep a storm of cost changes from spreading. With
+ * dv_damp_half_ms every change to a link's cost earns the link a
+ * penalty that halves each half-life, as routes are damped in RFC 2439.
+ * Past DV_DAMP_SUPPRESS routing holds the link at the dearest cost it
+ * was given since, so flapping back and forth changes nothing, until
+ * the penalty decays under DV_DAMP_REUSE and the link takes whatever
+ * cost it has by then. With dv_trigger_ms a neighbor gets at most one
+ * triggered update per interval: what changes in between is merged
+ * into the next one.
+ *
+ * With dv_link_state the adjacencies, sockets and timers here carry
+ * lsr.c instead, and no vectors are kept.
+ */
+#ifndef _DV_C_
+#define _DV_C_
+
+#define _GNU_SOURCE  // sendmmsg
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "dv.h"
+#include "es.h"
+#include "ls.h"
+#include "rt.h"
+#include "n2h.h"
+#include "queue.h"
+#include "lsr.h"
+#include "fwd.h"
+
+struct dv *g_dv;
+dv_output_fn dv_output = dv_sendmmsg;
+bool dv_link_state = false;
+unsigned int dv_damp_half_ms = 0;
+unsigned int dv_trigger_ms = 0;
+
+static uint8_t *dv_txbuf;       // datagrams of the update being sent
+static size_t dv_txcap;
+static node *dv_fast;           // destinations of one datagram rt_relax may take
+static size_t dv_fast_cap;
+static uint64_t *dv_moved;      // what it moved
+static uint64_t *dv_ties;       // and where it found another path
+static size_t dv_moved_cap;
+static cost *dv_held_c;         // held routes' costs while it runs
+static size_t dv_held_cap;
+static struct link **dv_adj;    // adjacencies with a vector, for dv_lfa and dv_protect
+static size_t dv_adj_cap;
+static struct link **dv_hop;    // cheapest live link to each neighbor, for dv_fib
+static size_t dv_hop_cap;
+
+uint64_t dv_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* is l one of our adjacencies? */
+bool dv_local(struct link *l) {
+	return (l->peer0 == g_dv->me) != (l->peer1 == g_dv->me);
+}
+
+static int dv_sock(struct link *l) {
+	return l->peer0 == g_dv->me ? l->sockfd0 : l->sockfd1;
+}
+
+node dv_peer(struct link *l) {
+	return l->peer0 == g_dv->me ? l->peer1 : l->peer0;
+}
+
+static int dv_peer_port(struct link *l) {
+	return l->peer0 == g_dv->me ? l->port1 : l->port0;
+}
+
+/* what routing takes l to cost */
+static cost dv_cost(struct link *l) {
+	return l->damped ? l->held : l->c;
+}
+
+static cost dv_add(cost a, cost b) {
+	if (a >= g_dv->inf || b >= g_dv->inf || a + b >= g_dv->inf)
+		return INF_COST;
+	return a + b;
+}
+
+void dv_route_changed(node d, uint64_t now) {
+	struct dv_stats *st = &g_dv->stats;
+
+	g_dv->changes++;
+	st->changes++;
+	if (!g_dv->lsr)
+		tw_mod(&g_dv->tw, &g_dv->lfa_due, now + DV_LFA_QUIET);
+	st->last_change = now;
+	if (!st->seen) {
+		st->seen = (uint64_t *) calloc (g_dv->cap / 64 + 1, sizeof(uint64_t));
+		assert (st->seen);
+	}
+	if (st->seen[d >> 6] >> (d & 63) & 1)
+		st->flaps++;
+	st->seen[d >> 6] |= 1ULL << (d & 63);
+}
+
+void dv_stats_print(struct dv_stats *st, int set, node who) {
+	char id[16] = "all";
+
+	if (who != NO_NODE)
+		snprintf(id, sizeof(id), "%u", who);
+	printf("[stats] set=%d node=%s engine=%s settle_ms=%llu changes=%lu flaps=%lu "
+		"tx_msgs=%lu tx_bytes=%lu rx_msgs=%lu rx_bytes=%lu switched=%lu damped=%lu "
+		"hello_tx=%lu hello_rx=%lu\n",
+		set, id, dv_link_state ? "ls" : "dv",
+		(unsigned long long)(st->last_change ? st->last_change - st->since : 0),
+		st->changes, st->flaps, st->tx_msgs, st->tx_bytes, st->rx_msgs, st->rx_bytes,
+		st->switched, st->damped, st->hello_tx, st->hello_rx);
+}
+
+void dv_stats_reset(uint64_t now) {
+	struct dv_stats *st = &g_dv->stats;
+	uint64_t *seen = st->seen;
+
+	if (seen && st->changes)
+		memset(seen, 0, (g_dv->cap / 64 + 1) * sizeof(uint64_t));
+	memset(st, 0, sizeof(struct dv_stats));
+	st->seen = seen;
+	st->since = now;
+}
+
+static void dv_periodic(struct tw_timer *t, uint64_t now);
+static void dv_expire_holddown(struct tw_timer *t, uint64_t now);
+static void dv_lfa(struct tw_timer *t, uint64_t now);
+static void dv_protect(struct link *l, cost c, uint64_t now);
+
+void dv_init(unsigned int update_time, unsigned int holddown, int verbose, uint64_t now) {
+	cost bound = get_cost_bound();
+
+	g_dv = (struct dv *) getmem (sizeof(struct dv));
+	assert (g_dv);
+	memset(g_dv, 0, sizeof(struct dv));
+	g_dv->me = get_myid();
+	g_dv->update_ms = update_time * 1000;
+	g_dv->holddown_ms = holddown;
+	g_dv->verbose = verbose;
+	g_dv->inf = bound < INF_COST - 1 ? bound + 1 : INF_COST - 1;
+
+	g_dv->cap = g_rt->cap;
+	if (dv_link_state) {
+		g_dv->lsr = lsr_init();
+	} else {
+		g_dv->changed = (uint64_t *) calloc (g_dv->cap / 64 + 1, sizeof(uint64_t));
+		// nobody has heard of any route yet, so there is nothing to take back
+		g_dv->age = (uint8_t *) malloc (g_dv->cap);
+		assert (g_dv->changed && g_dv->age);
+		memset(g_dv->age, DV_GC, g_dv->cap);
+	}
+
+	g_dv->stats.since = now;
+	tw_init(&g_dv->tw, now);
+	g_dv->rng = 0x9e3779b97f4a7c15ULL * (g_dv->me + 1);
+	g_dv->periodic.fn = dv_periodic;
+	g_dv->holddown.fn = dv_expire_holddown;
+	g_dv->lfa_due.fn = dv_lfa;
+	// the first full update goes out with the first links
+	tw_add(&g_dv->tw, &g_dv->periodic, now + g_dv->update_ms);
+}
+
+void dv_schedule(struct tw_timer *t, uint64_t when) {
+	tw_mod(&g_dv->tw, t, when);
+}
+
+/* update_ms give or take a sixth */
+static uint64_t dv_jitter() {
+	uint64_t x = g_dv->rng;
+	unsigned int span = g_dv->update_ms / 3;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	g_dv->rng = x;
+	return g_dv->update_ms - span / 2 + (span ? x % (span + 1) : 0);
+}
+
+/* queue d to be released at hd_until[d], they come out in that order */
+static void dv_hold(node d) {
+	if (g_dv->hd_len == g_dv->hd_qcap) {
+		size_t cap = g_dv->hd_qcap ? g_dv->hd_qcap * 2 : 64, i;
+		node *q = (node *) malloc (cap * sizeof(node));
+
+		assert (q);
+		for (i = 0; i < g_dv->hd_len; i++)
+			q[i] = g_dv->hd_q[(g_dv->hd_head + i) % g_dv->hd_qcap];
+		free(g_dv->hd_q);
+		g_dv->hd_q = q;
+		g_dv->hd_head = 0;
+		g_dv->hd_qcap = cap;
+	}
+	g_dv->hd_q[(g_dv->hd_head + g_dv->hd_len++) % g_dv->hd_qcap] = d;
+	if (!tw_pending(&g_dv->holddown))
+		tw_add(&g_dv->tw, &g_dv->holddown, g_dv->hd_until[d]);
+}
+
+static bool dv_held(node d, uint64_t now) {
+	return g_dv->hd_until && g_dv->hd_until[d] > now;
+}
+
+/* d used to cost old, hold it down unless it already is */
+static void dv_start_holddown(node d, cost old, uint64_t now) {
+	if (old == INF_COST || dv_held(d, now) || !g_dv->holddown_ms)
+		return;
+	if (!g_dv->hd_until) {
+		g_dv->hd_until = (uint64_t *) calloc (g_dv->cap, sizeof(uint64_t));
+		g_dv->hd_cost = (cost *) calloc (g_dv->cap, sizeof(cost));
+		assert (g_dv->hd_until && g_dv->hd_cost);
+	}
+	g_dv->hd_until[d] = now + g_dv->holddown_ms;
+	g_dv->hd_cost[d] = old;
+	dv_hold(d);
+}
+
+/* nh[0 .. *k) gets p if it is as cheap, the old next hop goes first */
+static void dv_tie(node *nh, unsigned int *k, node p, node onh) {
+	unsigned int i;
+
+	for (i = 0; i < *k && nh[i] != p; i++)
+		;
+	if (i == *k) {
+		if (*k < rt_max_paths)
+			(*k)++;
+		else if (p == onh)
+			i = *k - 1;
+		else
+			return;
+		nh[i] = p;
+	}
+	if (p == onh) {
+		nh[i] = nh[0];
+		nh[0] = p;
+	}
+}
+
+static void dv_recompute(node d, uint64_t now) {
+	struct link *l;
+	node onh = g_rt->nh[d], nh[RT_ECMP];
+	cost old = g_rt->c[d], c = INF_COST, via_old = INF_COST;
+	unsigned int k = 0;
+
+	for (l = g_ls->next; l != g_ls; l = l->next) {
+		node p;
+		cost lc;
+
+		if (!l->vec || !bfd_alive(l))
+			continue;
+		p = dv_peer(l);
+		lc = p == d ? dv_add(dv_cost(l), 0) : dv_add(dv_cost(l), l->vec[d]);
+		if (p == onh && lc < via_old)
+			via_old = lc;
+		if (lc < c) {
+			c = lc;
+			nh[0] = p;
+			k = 1;
+		} else if (lc == c && c != INF_COST)
+			dv_tie(nh, &k, p, onh);
+	}
+
+	/*
+	 * bad news from the next hop starts a hold-down, unless an equally
+	 * cheap path we already had is still there...
+	 */
+	if (via_old > old && (c > old || rte_npaths(g_rt, d) == 1))
+		dv_start_holddown(d, old, now);
+	/* ...during which only a path better than the one we lost counts */
+	if (dv_held(d, now) && k && nh[0] != onh && c >= g_dv->hd_cost[d]) {
+		c = via_old;
+		k = 0;
+	}
+	if (c == INF_COST || !k) {
+		nh[0] = onh;
+		k = 1;
+	}
+	if (same_rte_paths(d, c, nh, k))
+		return;
+
+	if (g_dv->verbose)
+		printf("[dv]\t node(%u) cost(%d) via(%u) -> cost(%d) via(%u)%s\n",
+			d, old, onh, c, nh[0], k > 1 ? " and others" : "");
+	update_rte_paths(d, c, nh, k);
+	g_dv->age[d] = 0;
+	g_dv->changed[d >> 6] |= 1ULL << (d & 63);
+	g_dv->dirty = true;
+	dv_route_changed(d, now);
+}
+
+static void dv_recompute_all(uint64_t now) {
+	node d;
+
+	for (d = next_rte(NO_NODE); d != NO_NODE; d = next_rte(d))
+		if (d < g_dv->cap)
+			dv_recompute(d, now);
+}
+
+/* release routes whose hold-down ran out to whatever is best now */
+static void dv_expire_holddown(struct tw_timer *t, uint64_t now) {
+	while (g_dv->hd_len) {
+		node d = g_dv->hd_q[g_dv->hd_head];
+
+		if (g_dv->hd_until[d] > now) {
+			tw_add(&g_dv->tw, t, g_dv->hd_until[d]);
+			return;
+		}
+		g_dv->hd_head = (g_dv->hd_head + 1) % g_dv->hd_qcap;
+		g_dv->hd_len--;
+		g_dv->hd_until[d] = 0;
+		dv_recompute(d, now);
+	}
+}
+
+/* forget what a neighbor that went away told us */
+void dv_neighbor_down(struct link *l, uint64_t now) {
+	node d;
+
+	if (g_dv->lsr) {
+		lsr_neighbor_down(l);
+		lsr_originate();
+		return;
+	}
+	dv_protect(l, INF_COST, now);
+	for (d = 0; d < g_dv->cap; d++)
+		l->vec[d] = INF_COST;
+	l->rx_seq = 0;  // it may come back restarted, counting from scratch
+	dv_recompute_all(now);
+}
+
+static void dv_neighbor_timeout(struct tw_timer *t, uint64_t now) {
+	struct link *l = tw_entry(t, struct link, timeout);
+
+	if (g_dv->verbose)
+		printf("[dv]\t nothing from node(%u) on %s, dropping its routes\n",
+			dv_peer(l), l->name);
+	dv_neighbor_down(l, now);
+}
+
+/*
+ * Each link socket only ever talks to the peer's end of the link, so
+ * connect it: the kernel then drops strays and tells us the path MTU
+ */
+static void dv_connect(struct link *l) {
+	struct sockaddr_in to;
+	int mtu;
+	socklen_t len = sizeof(mtu);
+
+	if (dv_sock(l) < 0) {
+		l->mtu = DV_MTU - 28;
+		return;
+	}
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr = *getaddrbynode(dv_peer(l));
+	to.sin_port = htons(dv_peer_port(l));
+	if (connect(dv_sock(l), (struct sockaddr *)&to, sizeof(to)) < 0)
+		perror("[dv] connect() failed");
+
+	if (getsockopt(dv_sock(l), IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+		mtu = DV_MTU;
+	mtu -= 28; // IP and UDP headers
+	l->mtu = mtu > DV_MAXDGRAM ? DV_MAXDGRAM : mtu;
+}
+
+void dv_sync_links(uint64_t now) {
+	struct link *l;
+	node d;
+
+	for (l = g_ls->next; l != g_ls; l = l->next) {
+		if (!dv_local(l) || l->adj)
+			continue;
+		l->adj = true;
+		if (g_dv->lsr) {
+			lsr_neighbor_up(l);
+		} else {
+			l->vec = (cost *) malloc (g_dv->cap * sizeof(cost));
+			assert (l->vec);
+			for (d = 0; d < g_dv->cap; d++)
+				l->vec[d] = INF_COST;
+		}
+		l->tx_seq = l->rx_seq = 0;
+		dv_connect(l);
+		l->timeout.fn = dv_neighbor_timeout;
+		tw_add(&g_dv->tw, &l->timeout, now + DV_TIMEOUT * g_dv->update_ms);
+		bfd_start(l, now);
+	}
+	if (g_dv->lsr)
+		lsr_originate();
+	else
+		dv_recompute_all(now);
+
+	// new neighbors need everything, send a full update right away
+	tw_mod(&g_dv->tw, &g_dv->periodic, now);
+}
+
+/*
+ * -------------------------------------
+ * Link cost damping
+ * -------------------------------------
+ */
+
+/* l's penalty at now; between whole half-lives 2^-x is taken as 1 - x/2 */
+static uint32_t dv_penalty(struct link *l, uint64_t now) {
+	uint64_t dt = now - l->pen_at, k = dt / dv_damp_half_ms;
+	uint32_t p = k >= 32 ? 0 : l->pen >> k;
+
+	return p - (uint32_t)((uint64_t)p * (dt % dv_damp_half_ms) / (2 * dv_damp_half_ms));
+}
+
+/* when l's penalty will be down to DV_DAMP_REUSE, by the same reckoning */
+static uint64_t dv_reuse_at(struct link *l) {
+	uint32_t p = l->pen;
+	uint64_t k = 0;
+
+	if (p <= DV_DAMP_REUSE)
+		return l->pen_at;
+	while (p >> (k + 1) > DV_DAMP_REUSE)
+		k++;
+	p >>= k;
+	return l->pen_at + k * dv_damp_half_ms +
+		((uint64_t)2 * dv_damp_half_ms * (p - DV_DAMP_REUSE) + p - 1) / p;
+}
+
+/* l has been quiet long enough to take the cost it has now */
+static void dv_reuse(struct tw_timer *t, uint64_t now) {
+	struct link *l = tw_entry(t, struct link, reuse);
+	uint64_t at = dv_reuse_at(l);
+
+	if (at > now) {
+		tw_add(&g_dv->tw, t, at);
+		return;
+	}
+	l->damped = false;
+	g_dv->damped--;
+	if (g_dv->verbose)
+		printf("[dv]\t %s reused at cost(%d), held at cost(%d)\n", l->name, l->c, l->held);
+	if (l->held != l->c)
+		dv_recompute_all(now);
+}
+
+/* l's cost is about to become c: charge l for it, returns the cost routing should see */
+static cost dv_damp(struct link *l, cost c, uint64_t now) {
+	uint32_t p = dv_penalty(l, now) + DV_DAMP_PENALTY;
+
+	l->pen = p < DV_DAMP_CEIL ? p : DV_DAMP_CEIL;
+	l->pen_at = now;
+	if (!l->damped && p > DV_DAMP_SUPPRESS) {
+		l->damped = true;
+		l->held = l->c;
+		l->reuse.fn = dv_reuse;
+		g_dv->damped++;
+		g_dv->stats.damped++;
+		if (g_dv->verbose)
+			printf("[dv]\t %s damped, penalty %u\n", l->name, p);
+	}
+	if (!l->damped)
+		return c;
+	if (c > l->held)
+		l->held = c;
+	tw_mod(&g_dv->tw, &l->reuse, dv_reuse_at(l));
+	return l->held;
+}
+
+/* the wheel's clock is the time of the event set being dispatched */
+void dv_del_link(struct link *l) {
+	tw_del(&g_dv->tw, &l->timeout);
+	if (tw_pending(&l->trig)) {
+		tw_del(&g_dv->tw, &l->trig);
+		g_dv->deferred--;
+	}
+	if (l->damped) {
+		tw_del(&g_dv->tw, &l->reuse);
+		g_dv->damped--;
+	}
+	bfd_stop(l);
+	if (bfd_interval && l->adj && l->bfd.state != BFD_UP)
+		g_dv->coming_up--;
+	if (l->vec)
+		dv_protect(l, INF_COST, g_dv->tw.now);
+}
+
+void dv_ud_link(struct link *l, cost c) {
+	cost old = dv_cost(l);
+
+	if (l->vec && dv_damp_half_ms && c != l->c)
+		c = dv_damp(l, c, g_dv->tw.now);
+	if (l->vec && c > old)
+		dv_protect(l, c, g_dv->tw.now);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v) {
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* returns where the next varint starts, or 0x0 if it runs past end */
+static uint8_t *get_varint(uint8_t *p, uint8_t *end, uint32_t *v) {
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*v |= (uint32_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return 0x0;
+}
+
+/* routes that go in an update: all of them, or the ones set in only */
+static node dv_next(node d, uint64_t *only) {
+	size_t w, words = g_dv->cap / 64 + 1;
+	uint64_t bits;
+
+	if (!only)
+		return next_rte(d);
+	d++; // NO_NODE wraps around to 0
+	w = d >> 6;
+	if (w >= words)
+		return NO_NODE;
+	bits = only[w] & (~0ULL << (d & 63));
+	while (!bits) {
+		if (++w >= words)
+			return NO_NODE;
+		bits = only[w];
+	}
+	return (node)(w * 64 + __builtin_ctzll(bits));
+}
+
+void dv_transmit(struct link *l, struct iovec *iov, size_t n) {
+	size_t i;
+
+	g_dv->stats.tx_msgs += n;
+	for (i = 0; i < n; i++)
+		g_dv->stats.tx_bytes += iov[i].iov_len;
+	dv_output(l, iov, n);
+}
+
+/* hand every datagram of an update to the kernel at once */
+void dv_sendmmsg(struct link *l, struct iovec *iov, size_t n) {
+	struct mmsghdr *msgs;
+	size_t sent;
+
+	if (dv_sock(l) < 0)
+		return;
+	msgs = (struct mmsghdr *) calloc (n, sizeof(struct mmsghdr));
+	assert (msgs);
+	for (sent = 0; sent < n; sent++) {
+		msgs[sent].msg_hdr.msg_iov = &iov[sent];
+		msgs[sent].msg_hdr.msg_iovlen = 1;
+	}
+	for (sent = 0; sent < n; ) {
+		int k = sendmmsg(dv_sock(l), msgs + sent, n - sent, 0);
+
+		if (k < 0) {
+			if (g_dv->verbose)
+				perror("[dv] sendmmsg() failed");
+			break;
+		}
+		sent += k;
+	}
+	free(msgs);
+}
+
+/* pack the update for l into as few datagrams as its MTU allows, only 0x0 for a full one */
+static void dv_send(struct link *l, uint64_t *only) {
+	struct iovec *iov;
+	node peer = dv_peer(l), d, prev = NO_NODE;
+	size_t ndgram = 0, max;
+	uint8_t *p = 0x0, *end = 0x0;
+	uint32_t seq = htonl(++l->tx_seq);
+	bool full = !only;
+
+	// every datagram holds at least this many routes
+	max = g_rt->n / ((l->mtu - DV_HDR) / DV_ENTRY) + 1;
+	if (max * l->mtu > dv_txcap) {
+		dv_txcap = max * l->mtu;
+		dv_txbuf = (uint8_t *) realloc (dv_txbuf, dv_txcap);
+		assert (dv_txbuf);
+	}
+	iov = (struct iovec *) calloc (max, sizeof(struct iovec));
+	assert (iov);
+
+	for (d = dv_next(NO_NODE, only); d != NO_NODE; d = dv_next(d, only)) {
+		cost c;
+
+		if (d >= g_dv->cap)
+			break;
+		if (end - p < DV_ENTRY) {
+			if (p) {
+				iov[ndgram].iov_len = p - (uint8_t *)iov[ndgram].iov_base;
+				ndgram++;
+			}
+			p = dv_txbuf + ndgram * l->mtu;
+			end = p + l->mtu;
+			iov[ndgram].iov_base = p;
+			p[0] = DV_TYPE;
+			p[1] = DV_VERSION;
+			p[2] = full ? 0 : DV_DELTA;
+			p[3] = 0;
+			memcpy(p + 4, &seq, 4);
+			p += DV_HDR;
+			prev = NO_NODE;
+		}
+		// collected routes only go out when they change
+		if (full && g_dv->age[d] >= DV_GC)
+			continue;
+		// poisoned reverse: never offer a neighbor its own route back
+		c = rte_via(d, peer) ? INF_COST : g_rt->c[d];
+		p = put_varint(p, d - prev - 1);
+		p = put_varint(p, c == INF_COST ? 0 : c + 1);
+		prev = d;
+	}
+	if (p) {
+		iov[ndgram].iov_len = p - (uint8_t *)iov[ndgram].iov_base;
+		ndgram++;
+	}
+
+	if (ndgram)
+		dv_transmit(l, iov, ndgram);
+	if (g_dv->verbose && ndgram)
+		printf("[dv]\t sent %s update %u in %zu datagrams on %s\n",
+			full ? "full" : "triggered", l->tx_seq, ndgram, l->name);
+	free(iov);
+}
+
+/* send l what it has been kept waiting for, and start its next interval */
+static void dv_send_pending(struct link *l, uint64_t now) {
+	if (tw_pending(&l->trig)) {
+		tw_del(&g_dv->tw, &l->trig);
+		g_dv->deferred--;
+	}
+	dv_send(l, l->pend);
+	memset(l->pend, 0, (g_dv->cap / 64 + 1) * sizeof(uint64_t));
+	l->trig_at = now + dv_trigger_ms;
+}
+
+static void dv_trigger_expire(struct tw_timer *t, uint64_t now) {
+	struct link *l = tw_entry(t, struct link, trig);
+
+	g_dv->deferred--;
+	dv_send_pending(l, now);
+}
+
+/* the changes so far go to l now, or with whatever follows once its interval is up */
+static void dv_trigger(struct link *l, uint64_t now) {
+	size_t i, words = g_dv->cap / 64 + 1;
+
+	if (!l->pend) {
+		l->pend = (uint64_t *) calloc (words, sizeof(uint64_t));
+		assert (l->pend);
+		l->trig.fn = dv_trigger_expire;
+	}
+	for (i = 0; i < words; i++)
+		l->pend[i] |= g_dv->changed[i];
+	if (now >= l->trig_at) {
+		dv_send_pending(l, now);
+	} else if (!tw_pending(&l->trig)) {
+		tw_add(&g_dv->tw, &l->trig, l->trig_at);
+		g_dv->deferred++;
+	}
+}
+
+static void dv_flush(bool full) {
+	struct link *l;
+	node d;
+
+	for (l = g_ls->next; l != g_ls; l = l->next) {
+		if (!l->vec)
+			continue;
+		if (full) {
+			dv_send(l, 0x0);
+			// everything held back just went out
+			if (l->pend && tw_pending(&l->trig)) {
+				tw_del(&g_dv->tw, &l->trig);
+				g_dv->deferred--;
+			}
+			if (l->pend)
+				memset(l->pend, 0, (g_dv->cap / 64 + 1) * sizeof(uint64_t));
+		} else if (dv_trigger_ms) {
+			dv_trigger(l, g_dv->tw.now);
+		} else {
+			dv_send(l, g_dv->changed);
+		}
+	}
+	memset(g_dv->changed, 0, (g_dv->cap / 64 + 1) * sizeof(uint64_t));
+	g_dv->dirty = false;
+	if (!full)
+		return;
+	for (d = 0; d < g_dv->cap; d++)
+		if (g_dv->age[d] < DV_GC && (!rt_valid(g_rt, d) || g_rt->c[d] == INF_COST))
+			g_dv->age[d]++;
+}
+
+/* a neighbor we stopped listening to is back, it needs everything */
+void dv_neighbor_up(struct link *l, uint64_t now) {
+	if (g_dv->lsr) {
+		lsr_originate();
+		return;
+	}
+	// routes were computed without l while its session came up, or went down
+	dv_recompute_all(now);
+	dv_send(l, 0x0);
+}
+
+static void dv_periodic(struct tw_timer *t, uint64_t now) {
+	if (g_dv->lsr)
+		lsr_hello();
+	else
+		dv_flush(true);
+	tw_add(&g_dv->tw, t, now + dv_jitter());
+}
+
+static void *dv_grow(void *p, size_t *cap, size_t want, size_t size) {
+	if (want <= *cap)
+		return p;
+	while (*cap < want)
+		*cap = *cap ? *cap * 2 : 64;
+	p = realloc (p, *cap * size);
+	assert (p);
+	return p;
+}
+
+/*
+ * -------------------------------------
+ * Loop-free alternates
+ * -------------------------------------
+ */
+
+/* the live adjacencies that have a vector, into dv_adj, returns how many */
+static size_t dv_adjacencies() {
+	struct link *l;
+	size_t n = 0;
+
+	for (l = g_ls->next; l != g_ls; l = l->next)
+		if (l->vec && bfd_alive(l)) {
+			dv_adj = (struct link **) dv_grow (dv_adj, &dv_adj_cap, n + 1,
+				sizeof(struct link *));
+			dv_adj[n++] = l;
+		}
+	return n;
+}
+
+/* what d costs through the peer of l, if that is loop-free for a route costing c */
+static cost dv_alternate(struct link *l, node d, cost c) {
+	if (dv_peer(l) == d)
+		return dv_add(dv_cost(l), 0);
+	return l->vec[d] < c ? dv_add(dv_cost(l), l->vec[d]) : INF_COST;
+}
+
+/*
+ * Routes have been quiet for a while: find each one's cheapest loop-free
+ * alternate, and list on every link the routes it carries that could
+ * go somewhere else without it
+ */
+static void dv_lfa(struct tw_timer *t, uint64_t now) {
+	size_t nadj = dv_adjacencies(), i;
+	node d;
+
+	if (!g_dv->lfa) {
+		g_dv->lfa = (node *) malloc (g_dv->cap * sizeof(node));
+		assert (g_dv->lfa);
+	}
+	for (i = 0; i < nadj; i++)
+		dv_adj[i]->nprot = 0;
+	for (d = 0; d < g_dv->cap; d++) {
+		cost c = g_rt->c[d], best = INF_COST;
+
+		g_dv->lfa[d] = NO_NODE;
+		if (!rt_valid(g_rt, d) || c == INF_COST)
+			continue;
+		for (i = 0; i < nadj; i++) {
+			node p = dv_peer(dv_adj[i]);
+			cost lc;
+
+			if (rte_via(d, p) || (lc = dv_alternate(dv_adj[i], d, c)) >= best)
+				continue;
+			best = lc;
+			g_dv->lfa[d] = p;
+		}
+		if (g_dv->lfa[d] == NO_NODE && rte_npaths(g_rt, d) == 1)
+			continue;
+		for (i = 0; i < nadj; i++) {
+			struct link *l = dv_adj[i];
+
+			if (!rte_via(d, dv_peer(l)))
+				continue;
+			l->prot = (node *) dv_grow (l->prot, &l->prot_cap, l->nprot + 1, sizeof(node));
+			l->prot[l->nprot++] = d;
+		}
+	}
+	if (g_dv->verbose)
+		printf("[dv]\t loop-free alternates recomputed\n");
+}
+
+/*
+ * l is about to cost c, INF_COST if it is going away. Move what dv_lfa
+ * listed on it to another of the route's next hops, or else to its
+ * alternate if that is cheaper than staying, and hold it down from
+ * there so only news better than the lost path can move it again.
+ */
+static void dv_protect(struct link *l, cost c, uint64_t now) {
+	size_t nadj, i, j;
+	node peer = dv_peer(l);
+
+	if (!l->nprot || !g_dv->lfa)
+		return;
+	nadj = dv_adjacencies();
+	for (i = 0; i < l->nprot; i++) {
+		node d = l->prot[i], nh[RT_ECMP], b = g_dv->lfa[d];
+		cost old = g_rt->c[d], stay, alt = INF_COST;
+		unsigned int k, n = 0;
+
+		if (!rt_valid(g_rt, d) || !rte_via(d, peer))
+			continue; // moved since dv_lfa ran
+		stay = c == INF_COST ? INF_COST : peer == d ? dv_add(c, 0) : dv_add(c, l->vec[d]);
+		if (stay <= old)
+			continue;
+		for (k = 0; k < rte_npaths(g_rt, d); k++)
+			if (rte_hop(g_rt, d, k) != peer)
+				nh[n++] = rte_hop(g_rt, d, k);
+		if (n) {
+			// the other hops were as cheap and still are
+			update_rte_paths(d, old, nh, n);
+		} else {
+			for (j = 0; j < nadj; j++)
+				if (dv_adj[j] != l && dv_peer(dv_adj[j]) == b)
+					alt = dv_alternate(dv_adj[j], d, old);
+			if (alt >= stay)
+				continue;
+			update_rte(d, alt, b);
+			dv_start_holddown(d, old, now);
+		}
+		if (g_dv->verbose)
+			printf("[dv]\t node(%u) cost(%d) via(%u) -> cost(%d) via(%u), alternate\n",
+				d, old, peer, g_rt->c[d], g_rt->nh[d]);
+		g_dv->age[d] = 0;
+		g_dv->changed[d >> 6] |= 1ULL << (d & 63);
+		g_dv->dirty = true;
+		g_dv->stats.switched++;
+		dv_route_changed(d, now);
+	}
+}
+
+/*
+ * Routes not through l can only get cheaper when l's vector changes,
+ * and rt_relax takes a whole range of them at once. Held routes follow
+ * their own rules in dv_recompute, so for the length of the call they
+ * cost nothing and cannot move.
+ */
+static void dv_relax(struct link *l, node lo, node hi, uint64_t now) {
+	size_t i, nheld = 0;
+	node d;
+
+	if (dv_moved_cap < g_dv->cap / 64 + 1) {
+		// all clear between calls, so a bigger one can start out clear
+		free(dv_moved);
+		free(dv_ties);
+		dv_moved_cap = g_dv->cap / 64 + 1;
+		dv_moved = (uint64_t *) calloc (dv_moved_cap, sizeof(uint64_t));
+		dv_ties = (uint64_t *) calloc (dv_moved_cap, sizeof(uint64_t));
+		assert (dv_moved && dv_ties);
+	}
+	for (i = 0; i < g_dv->hd_len; i++) {
+		d = g_dv->hd_q[(g_dv->hd_head + i) % g_dv->hd_qcap];
+		if (d < lo || d >= hi)
+			continue;
+		dv_held_c = (cost *) dv_grow (dv_held_c, &dv_held_cap, nheld + 1, sizeof(cost));
+		dv_held_c[nheld++] = g_rt->c[d];
+		g_rt->c[d] = 0;
+	}
+	rt_relax(l->vec, dv_add(dv_cost(l), 0), dv_peer(l), g_dv->inf, lo, hi, dv_moved,
+		rt_max_paths > 1 ? dv_ties : 0x0);
+	// backwards, a route held twice over saved a 0 the second time
+	for (i = g_dv->hd_len; i-- > 0; ) {
+		d = g_dv->hd_q[(g_dv->hd_head + i) % g_dv->hd_qcap];
+		if (d >= lo && d < hi)
+			g_rt->c[d] = dv_held_c[--nheld];
+	}
+
+	for (i = lo >> 6; i <= (hi - 1) >> 6; i++) {
+		while (dv_moved[i]) {
+			d = i * 64 + __builtin_ctzll(dv_moved[i]);
+			dv_moved[i] &= dv_moved[i] - 1;
+			if (g_rt->paths)
+				g_rt->paths[d] = 1;
+			if (g_dv->verbose)
+				printf("[dv]\t node(%u) -> cost(%d) via(%u)\n",
+					d, g_rt->c[d], g_rt->nh[d]);
+			g_dv->age[d] = 0;
+			g_dv->changed[i] |= 1ULL << (d & 63);
+			g_dv->dirty = true;
+			dv_route_changed(d, now);
+		}
+		// one more way there, the cost we advertise stays the same
+		while (dv_ties[i]) {
+			d = i * 64 + __builtin_ctzll(dv_ties[i]);
+			dv_ties[i] &= dv_ties[i] - 1;
+			if ((g_dv->hd_until && g_dv->hd_until[d]) || !add_rte_hop(d, dv_peer(l)))
+				continue;
+			if (g_dv->verbose)
+				printf("[dv]\t node(%u) cost(%d) also via(%u)\n",
+					d, g_rt->c[d], dv_peer(l));
+			g_dv->changed[i] |= 1ULL << (d & 63);
+			g_dv->dirty = true;
+			dv_route_changed(d, now);
+		}
+	}
+}
+
+void dv_input(struct link *l, uint8_t *buf, size_t len, uint64_t now) {
+	uint8_t *p = buf + DV_HDR, *end = buf + len;
+	uint32_t seq;
+	node d = NO_NODE, peer;
+	size_t nfast = 0, i;
+
+	if (!l->adj)
+		return;
+	if (bfd_input(l, buf, len, now)) {
+		g_dv->stats.hello_rx++;
+		return;
+	}
+	g_dv->stats.rx_msgs++;
+	g_dv->stats.rx_bytes += len;
+	if (!bfd_alive(l))
+		return;
+	if (g_dv->lsr) {
+		if (lsr_input(l, buf, len))
+			tw_mod(&g_dv->tw, &l->timeout, now + DV_TIMEOUT * g_dv->update_ms);
+		return;
+	}
+	if (len < DV_HDR || buf[0] != DV_TYPE || buf[1] != DV_VERSION)
+		return;
+	memcpy(&seq, buf + 4, 4);
+	seq = ntohl(seq);
+	// a delta from before the last update would undo newer news
+	if ((buf[2] & DV_DELTA) && (int32_t)(seq - l->rx_seq) < 0)
+		return;
+	// a reordered full update still counts, but must not make older deltas look new
+	if ((int32_t)(seq - l->rx_seq) > 0)
+		l->rx_seq = seq;
+	tw_mod(&g_dv->tw, &l->timeout, now + DV_TIMEOUT * g_dv->update_ms);
+
+	peer = dv_peer(l);
+	while (p < end) {
+		uint32_t gap, c;
+
+		if (!(p = get_varint(p, end, &gap)) || !(p = get_varint(p, end, &c)))
+			break;
+		d += gap + 1;
+		if (d >= g_dv->cap)
+			break;
+		c = c ? c - 1 : INF_COST;
+		if (d == g_dv->me || !rt_valid(g_rt, d))
+			continue;
+		if (c >= g_dv->inf)
+			c = INF_COST;
+		if (l->vec[d] == c)
+			continue;
+		l->vec[d] = c;
+		// news about our route through l may be bad, a held one has rules
+		if (rte_via(d, peer) || (g_dv->hd_until && g_dv->hd_until[d])) {
+			dv_recompute(d, now);
+			continue;
+		}
+		dv_fast = (node *) dv_grow (dv_fast, &dv_fast_cap, nfast + 1, sizeof(node));
+		dv_fast[nfast++] = d;
+	}
+	if (!nfast)
+		return;
+	// a dense run is cheaper to relax as a range than route by route
+	if (nfast >= DV_DENSE && dv_fast[nfast - 1] - dv_fast[0] < nfast * DV_DENSE) {
+		dv_relax(l, dv_fast[0], dv_fast[nfast - 1] + 1, now);
+		return;
+	}
+	for (i = 0; i < nfast; i++)
+		dv_recompute(dv_fast[i], now);
+}
+
+/*
+ * Fire every timer that is due, then send a triggered update if the
+ * input since the last call changed something
+ */
+uint64_t dv_timers(uint64_t now) {
+	tw_advance(&g_dv->tw, now);
+	if (g_dv->dirty && g_dv->lsr)
+		lsr_flush(now);
+	else if (g_dv->dirty)
+		dv_flush(false);
+	return tw_next(&g_dv->tw);
+}
+
+/*
+ * For the simulator: act as if every periodic update up to <t> went out
+ * and changed nothing. The periodic timer keeps its phase, neighbors
+ * count as heard from at <t> and unreachable routes age as they would
+ * have. Nothing may be held down.
+ */
+void dv_skip(uint64_t t) {
+	uint64_t next = g_dv->periodic.expires, n = 0;
+	struct link *l;
+	node d;
+
+	assert (!g_dv->hd_len && !g_dv->damped && !g_dv->deferred);
+	if (next < t)
+		n = (t - next + g_dv->update_ms - 1) / g_dv->update_ms;
+	next += n * g_dv->update_ms;
+	for (d = 0; n && g_dv->age && d < g_dv->cap; d++)
+		if (g_dv->age[d] < DV_GC && (!rt_valid(g_rt, d) || g_rt->c[d] == INF_COST))
+			g_dv->age[d] = g_dv->age[d] + n < DV_GC ? g_dv->age[d] + n : DV_GC;
+
+	tw_del(&g_dv->tw, &g_dv->periodic);
+	for (l = g_ls->next; l != g_ls; l = l->next) {
+		tw_del(&g_dv->tw, &l->timeout);
+		bfd_stop(l);
+	}
+	tw_advance(&g_dv->tw, t);
+	tw_add(&g_dv->tw, &g_dv->periodic, next);
+	for (l = g_ls->next; l != g_ls; l = l->next)
+		if (l->adj) {
+			tw_add(&g_dv->tw, &l->timeout, t + DV_TIMEOUT * g_dv->update_ms);
+			bfd_resume(l, t);
+		}
+}
+
+void dv_stop() {
+	g_dv->stop = true;
+}
+
+/*
+ * Publish a new FIB snapshot if a route or a link has changed since the
+ * last one. A next hop becomes our end of the cheapest live link to it.
+ */
+static void dv_fib() {
+	struct link *l;
+	node d, p;
+
+	if (g_fwd->fib && g_fwd->changes == g_dv->changes && g_fwd->links == ls_gen)
+		return;
+	dv_hop = (struct link **) dv_grow (dv_hop, &dv_hop_cap, g_rt->cap,
+		sizeof(struct link *));
+	memset(dv_hop, 0, g_rt->cap * sizeof(struct link *));
+	for (l = g_ls->next; l != g_ls; l = l->next) {
+		if (!l->adj || !bfd_alive(l) || dv_sock(l) < 0)
+			continue;
+		p = dv_peer(l);
+		if (p < g_rt->cap && (!dv_hop[p] || dv_cost(l) < dv_cost(dv_hop[p])))
+			dv_hop[p] = l;
+	}
+
+	fib_begin(g_rt->cap);
+	for (d = 0; d < g_rt->cap; d++) {
+		int sd[RT_ECMP];
+		unsigned int k, n = 0;
+
+		if (!rt_valid(g_rt, d) || g_rt->c[d] == INF_COST)
+			continue;
+		for (k = 0; k < rte_npaths(g_rt, d); k++) {
+			p = rte_hop(g_rt, d, k);
+			if (p < g_rt->cap && dv_hop[p])
+				sd[n++] = dv_sock(dv_hop[p]);
+		}
+		if (n)
+			fib_set(d, sd, n);
+	}
+	fib_publish();
+	g_fwd->changes = g_dv->changes;
+	g_fwd->links = ls_gen;
+}
+
+/* read everything waiting on one end of l, data packets are forwarded */
+static void dv_drain(struct link *l, int sd, uint64_t now) {
+	if (sd < 0)
+		return;
+	fwd_drain(l, sd, sd == dv_sock(l) ? dv_input : 0x0, now);
+}
+
+/*
+ * Exchange vectors with every neighbor until a timer calls dv_stop. The
+ * link set keeps its sockets in an epoll set as links come and go, and
+ * the wait lasts until the nearest deadline on the wheel, so a router
+ * with nothing due and nothing arriving does no work. Data packets are
+ * forwarded over the FIB as it stood when the wait began.
+ */
+void dv_run() {
+	struct epoll_event evs[DV_EVENTS];
+	int n, i;
+
+	g_dv->stop = false;
+	for (;;) {
+		uint64_t now = dv_now(), wake = dv_timers(now);
+
+		if (g_dv->stop)
+			break;
+		// once a wakeup: what the timers and the last drain changed
+		dv_fib();
+		n = epoll_wait(g_ls_epfd, evs, DV_EVENTS, wake == TW_NEVER ? -1 :
+			wake - now > INT32_MAX ? INT32_MAX : (int)(wake - now));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait() failed");
+			exit(1);
+		}
+		now = dv_now();
+		for (i = 0; i < n; i++) {
+			struct link *l = (struct link *) evs[i].data.ptr;
+
+			// a link to myself has both ends here
+			dv_drain(l, l->sockfd0, now);
+			dv_drain(l, l->sockfd1, now);
+		}
+	}
+}
+
+#endif
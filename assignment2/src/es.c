@@ -6,69 +6,62 @@
  * $Revision: 1.1 $
  */
 
-#include <arpa/inet.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <sys/poll.h>
-#include <sys/socket.h>
-#include <sys/time.h>
 #include <string.h>
 
-#include "queue.h"
 #include "common.h"
 #include "es.h"
 #include "ls.h"
 #include "rt.h"
 #include "n2h.h"
+#include "intern.h"
+#include "dv.h"
+#include "sc.h"
+#include "fwd.h"
 
-static struct el *g_el;
+static struct el *g_el;      // event sets
+static size_t g_nel, g_elcap;
+static struct es *g_es;      // their events, back to back
+static size_t g_nes, g_escap;
+static cost g_cost_bound;  // sum of every cost any link is given
 
 int init_new_el() {
-	InitDQ(g_el, struct el);
-	assert (g_el);
-
-	g_el->es_head = 0x0;
-	return (g_el != 0x0);
+	free_el();
+	return 1;
 }
 
 void add_new_es() {
-	struct es *n_es;
-	struct el *n_el = (struct el*)getmem(sizeof(struct el));
-
-	struct el *tail = g_el->prev;
-	InsertDQ(tail, n_el);
-
-	// added new es to tail
-	// lets start a new queue here
-  
-	{
-		struct es *nhead = tail->es_head;
-		InitDQ(nhead, struct es);
-
-		tail = g_el->prev;     
-		tail->es_head = nhead; 
-
-		n_es = nhead;
-
-		n_es->ev = _es_null;
-		n_es->peer0 = n_es->peer1 =
-		n_es->port0 = n_es->port1 =
-		n_es->cost = -1;
-		n_es->name = 0x0;
+	if (g_nel == g_elcap) {
+		g_elcap = g_elcap ? g_elcap * 2 : 16;
+		g_el = (struct el *) realloc (g_el, g_elcap * sizeof(struct el));
+		assert (g_el);
 	}
+	// a new set starts where the events so far end
+	g_el[g_nel].first = g_nes;
+	g_el[g_nel].count = 0;
+	g_nel++;
 }
 
 void add_to_last_es(e_type ev, node peer0, int port0, node peer1, int port1, int cost, char *name) {
-	struct el *tail = g_el->prev;
 	bool local_event = false;
+	struct es *n_es;
   
-	assert(tail->es_head);
+	assert(g_nel);
+
+	// every node sees every event here, so they all agree on the bound
+	if ((ev == _es_link || ev == _ud_link) && cost > 0)
+		g_cost_bound = g_cost_bound + cost < g_cost_bound ?
+			INF_COST : g_cost_bound + cost;
 
 	// check for re-defined link (for establish)
 	// check for local event (for tear-down, update)
-	switch (ev) {
+	// the simulator (no id of its own) plays every node
+	if (get_myid() == NO_NODE)
+		local_event = true;
+	else switch (ev) {
 	case _es_link:
 		// a local event?
 		if (peer0 == get_myid() || peer1 == get_myid())
@@ -76,12 +69,12 @@ void add_to_last_es(e_type ev, node peer0, int port0, node peer1, int port1, int
 		break;
 	case _ud_link:
 		// a local event?
-		if (geteventbylink(name))
+		if (is_local_link(name))
 			local_event = true;
 		break;
 	case _td_link:
 		// a local event?
-		if (geteventbylink(name))
+		if (is_local_link(name))
 			local_event = true;
 		break;
 	default:
@@ -96,108 +89,125 @@ void add_to_last_es(e_type ev, node peer0, int port0, node peer1, int port1, int
 
 	printf("[es]\t Adding into local event\n");
 
-	{
-		struct es *es_tail = tail->es_head->prev;
-    
-		struct es *n_es = (struct es *)getmem(sizeof(struct es));
-    
-		n_es->ev = ev;
-		n_es->peer0 = peer0;
-		n_es->port0 = port0;
-		n_es->peer1 = peer1;
-		n_es->port1 = port1;
-		n_es->cost = cost;
-		n_es->name = (char *)getmem(strlen(name) + 1);
-		strcpy(n_es->name, name);
-
-		InsertDQ(es_tail, n_es);
+	if (g_nes == g_escap) {
+		g_escap = g_escap ? g_escap * 2 : 64;
+		g_es = (struct es *) realloc (g_es, g_escap * sizeof(struct es));
+		assert (g_es);
 	}
+	n_es = &g_es[g_nes++];
+	n_es->ev = ev;
+	n_es->peer0 = peer0;
+	n_es->port0 = port0;
+	n_es->peer1 = peer1;
+	n_es->port1 = port1;
+	n_es->cost = cost;
+	n_es->name = intern(name);
+	find_iname(n_es->name)->local = true;
+	g_el[g_nel - 1].count++;
 }
 
 /*
- * A simple walk of event sets: dispatch and print a event SET every 2 sec
+ * Dispatch an event set straight out of a mapped scenario image. The
+ * image holds every node's events, so the ones that are not ours are
+ * skipped here rather than at parse time.
  */
-void walk_el(int update_time, int time_between, int verb) {
-	struct el *el;
-	struct es *es_hd;
-	struct es *es;
-
-	struct pollfd sds[64];
-	size_t sds_len = 0;
+static void dispatch_image_set(struct sc_set *set) {
+	struct sc_event *e = sc_events(g_sc) + set->first;
+	uint32_t i;
 
-	uint8_t *buf = malloc(65536);
-	buf[0] = ntohl(0x7);
-	buf[1] = ntohl(0x1);
+	for (i = 0; i < set->count; i++, e++) {
+		struct es es;
 
-	UNUSED(verb);
-
-	assert(g_el->next);
-  
-	print_el();
-
-	/* initialize link set, routing table, and routing table */
-	create_ls();
-	create_rt();
-	init_rt_from_n2h();
-	
-	for (el = g_el->next; el != g_el; el = el->next) {
-		assert(el);
-		es_hd = el->es_head;
-		assert (es_hd);
-	
-		printf("[es] >>>>>>>>>> Dispatch next event set <<<<<<<<<<<<<\n");
-		for (es = es_hd->next; es != es_hd; es=es->next) {
-			printf("[es] Dispatching next event ... \n");
-			dispatch_event(es);
+		if (e->name >= g_sc->strings_len || e->ev < _es_link || e->ev > _td_link) {
+			printf("[es]\t\tCorrupt event, skip\n");
+			continue;
 		}
+		es.ev = e->ev;
+		es.peer0 = e->peer0;
+		es.port0 = e->port0;
+		es.peer1 = e->peer1;
+		es.port1 = e->port1;
+		es.cost = e->cost;
+		es.name = sc_str(g_sc, e->name);
+		if (es.ev == _es_link ? es.peer0 != get_myid() && es.peer1 != get_myid()
+		    : !find_link(es.name))
+			continue;
+		printf("[es] Dispatching next event ... \n");
+		dispatch_event(&es);
+	}
+}
 
-		sds_len = 0;
-		// Add peers to pollfd list
-		for (struct link *ls = g_ls->next; ls != g_ls; ls = ls->next) {
-			if (is_me(ls->peer0)) {
-				sds[sds_len].fd = ls->peer1;
-				sds[sds_len].events = POLLIN | POLLOUT;
-				sds_len++;
-			} else if (is_me(ls->peer1)) {
-				sds[sds_len].fd = ls->peer0;
-				sds[sds_len].events = POLLIN | POLLOUT;
-				sds_len++;
-			}
-		}
+/* event sets are paced by a timer on the router's wheel */
+static struct tw_timer pace;
+static size_t next_set;
+static uint64_t time_between_ms;
 
-		*(uint16_t *)&buf[2] = 0;
-		for (struct rte *route = g_rt->next; route != g_rt; route = route->next) {
-			uint16_t *i = (uint16_t *)&buf[2];
-			buf[4] = htonl(route->d);
-			*(uint16_t *)&buf[4 * *i + 2] = htonl(route->c);
-			(*i)++;
-		}
-		*(uint16_t *)&buf[2] = htonl(*(uint16_t *)&buf[2]);
-
-		/* Run DISTANCE VECTOR ALGORITHM */
-		int done = 0;
-		int timeout = update_time * 1000;
-		while (!done) switch (poll(sds, sds_len, timeout)) {
-			case -1:
-				perror("poll() failed");
-				exit(1);
-			case 0:
-				// send out update
-				break;
-			default:;
-				int num_routes = ntohl(*(uint16_t *)&buf[2]);
-				for (int i = 0; i < sds_len; i++) {
-					if (sds[i].revents & POLLOUT) {
-						send(sds[i].fd, buf, 4 + 4 * num_routes, 0);
-					}
-				}
-		}
+/*
+ * Print what distance vector converged to since the last event set, then
+ * dispatch the next one, or stop after the last
+ */
+static void pace_sets(struct tw_timer *t, uint64_t now) {
+	size_t nsets = g_sc ? g_sc->nsets : g_nel, i;
+	struct es *es;
 
+	if (next_set) {
 		printf("[es] >>>>>>> Start dumping data stuctures <<<<<<<<<<<\n");
 		print_n2h();
 		print_ls();
 		print_rt();
+		dv_stats_print(&g_dv->stats, next_set - 1, g_dv->me);
+		if (g_fwd->rx)
+			fwd_print(next_set - 1);
+	}
+	dv_stats_reset(now);
+	if (next_set == nsets) {
+		dv_stop();
+		return;
 	}
+
+	printf("[es] >>>>>>>>>> Dispatch next event set <<<<<<<<<<<<<\n");
+	if (g_sc) {
+		dispatch_image_set(&sc_sets(g_sc)[next_set]);
+	} else {
+		es = get_es(&g_el[next_set]);
+		for (i = 0; i < g_el[next_set].count; i++) {
+			printf("[es] Dispatching next event ... \n");
+			dispatch_event(&es[i]);
+		}
+	}
+	next_set++;
+	dv_sync_links(now);
+	dv_schedule(t, now + time_between_ms);
+}
+
+/*
+ * Walk the event sets: dispatch one, then let distance vector settle
+ * for <time_between> seconds
+ */
+void walk_el(int update_time, int time_between, int holddown, int verb) {
+	uint64_t now = dv_now();
+
+	if (g_sc) {
+		printf("[es] scenario image: %u nodes, %u event sets, %u events\n",
+			g_sc->nnodes, g_sc->nsets, g_sc->nevents);
+	} else {
+		assert(g_nel);
+		print_el();
+	}
+
+	/* initialize link set, routing table, and routing table */
+	create_ls();
+	create_rt();
+	init_rt_from_n2h();
+	dv_init(update_time, holddown, verb, now);
+	create_fwd(get_myid());
+
+	/* Run DISTANCE VECTOR ALGORITHM */
+	time_between_ms = (uint64_t)time_between * 1000;
+	next_set = 0;
+	pace.fn = pace_sets;
+	dv_schedule(&pace, now);
+	dv_run();
 }
 
 /*
@@ -213,9 +223,11 @@ void dispatch_event(struct es *es) {
 		add_link(es->peer0, es->port0, es->peer1, es->port1, es->cost, es->name);
 		break;
 	case _ud_link:
+		dv_ud_link(find_link(es->name), es->cost);
 		ud_link(es->name, es->cost);
 		break;
 	case _td_link:
+		dv_del_link(find_link(es->name));
 		del_link(es->name);
 		break;
 	default:
@@ -229,27 +241,23 @@ void dispatch_event(struct es *es) {
  * print out the whole event LIST
  */
 void print_el() {
-	struct el *el;
-	struct es *es_hd;
 	struct es *es;
+	size_t i, j;
 
-	assert (g_el->next);
+	assert (g_nel);
 
 	printf("\n\n");
 	printf("[es] >>>>>>>>>>>>>>>>>>>>>><<<<<<<<<<<<<<<<<<<<<<<<<<\n");
 	printf("[es] >>>>>>>>>> Dumping all event sets  <<<<<<<<<<<<<\n");
 	printf("[es] >>>>>>>>>>>>>>>>>>>>>><<<<<<<<<<<<<<<<<<<<<<<<<<\n");
 
-	for (el = g_el->next; el != g_el; el = el->next) {
-
-		assert(el);
-		es_hd = el->es_head;
-		assert (es_hd);
+	for (i = 0; i < g_nel; i++) {
+		es = get_es(&g_el[i]);
 	
 		printf("\n[es] ***** Dumping next event set *****\n");
 
-		for (es=es_hd->next; es!=es_hd; es=es->next)
-			print_event(es);
+		for (j = 0; j < g_el[i].count; j++)
+			print_event(&es[j]);
 	}     
 }
 
@@ -282,25 +290,60 @@ void print_event(struct es *es) {
 	printf("[es]\t cost(%d)\n", es->cost);
 }
 
-struct es *geteventbylink(char *lname) {
-	struct el *el;
-	struct es *es_hd;
-	struct es *es;
+/*
+ * has a local event named link <lname>?
+ */
+bool is_local_link(char *lname) {
+	struct iname *i;
 
-	assert (g_el->next);
 	assert (lname);
 
-	for (el = g_el->next ; el != g_el ; el = el->next) {
-		assert(el);
-		es_hd = el->es_head;
-		assert (es_hd);
-	
-		for (es=es_hd->next ; es!=es_hd ; es=es->next)
-			if (!strcmp(lname, es->name))
-				return es;
-	}
-	return 0x0;
+	i = find_iname(lname);
+	return i && i->local;
 }
 
-#endif
+/* the parsed event sets, for drivers that dispatch events themselves */
+struct el *get_el(size_t *nsets) {
+	*nsets = g_nel;
+	return g_el;
+}
 
+struct es *get_es(struct el *el) {
+	return g_es + el->first;
+}
+
+/*
+ * Events hold no memory of their own (names are interned), so the whole
+ * scenario goes with two frees
+ */
+void free_el() {
+	free(g_el);
+	free(g_es);
+	g_el = 0x0;
+	g_es = 0x0;
+	g_nel = g_elcap = 0;
+	g_nes = g_escap = 0;
+}
+
+/*
+ * Tear the whole scenario down: event sets, hosts, links and the names
+ * they share. Each of those is a few frees, whatever the scenario's
+ * size. Call free_ls on every link set first.
+ */
+void free_scenario() {
+	free_el();
+	free_n2h();
+	release_links();
+	free_names();
+	g_cost_bound = 0;
+}
+
+void set_cost_bound(cost c) {
+	g_cost_bound = c;
+}
+
+cost get_cost_bound() {
+	return g_cost_bound;
+}
+
+#endif
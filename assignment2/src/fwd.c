@@ -0,0 +1,256 @@
+/* $Id$
+ * Data plane: forwarding over the routing table
+ *
+ * fwd_drain takes up to fwd_batch datagrams per recvmmsg, looks each
+ * data packet up in the FIB, and queues it in place in the receive
+ * buffer. What is queued goes out before the next recvmmsg, one
+ * sendmmsg per outgoing socket. No packet is copied on the way through.
+ *
+ * The FIB is read-copy-update. Routing never touches the snapshot
+ * readers have: fib_begin/fib_set fill a new one and fib_publish swaps
+ * it in with one atomic store, then frees the old ones no reader can
+ * still see (epoch-based reclamation). A lookup thread only ever writes
+ * its own slot in reader[], so it never waits for routing and routing
+ * never waits for it.
+ */
+#ifndef _FWD_C_
+#define _FWD_C_
+
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "fwd.h"
+#include "queue.h"
+
+struct fwd *g_fwd;
+unsigned int fwd_batch = FWD_BATCH;
+
+/*
+ * Scratch space. Only one router runs at a time, one thread drains,
+ * and a drain sends everything it queued before it returns, so all of
+ * them share it.
+ */
+static uint8_t *rx;                     // fwd_batch receive buffers
+static struct mmsghdr rx_msg[FWD_BATCH];
+static struct iovec rx_iov[FWD_BATCH];
+static int q_sd[FWD_BATCH];             // packets to send, and where
+static struct iovec q_iov[FWD_BATCH];
+static size_t q_len;
+
+static unsigned int fwd_threads;         // reader slots handed out
+static __thread int fwd_slot = -1;       // this thread's
+
+int create_fwd(node me) {
+	g_fwd = (struct fwd *) getmem (sizeof(struct fwd));
+	assert (g_fwd);
+	memset(g_fwd, 0, sizeof(struct fwd));
+	g_fwd->me = me;
+	g_fwd->epoch = 1;
+	return (g_fwd != 0x0);
+}
+
+void fib_begin(node cap) {
+	size_t size = sizeof(struct fib) + (size_t)cap * sizeof(struct fib_entry);
+
+	free(g_fwd->next);
+	g_fwd->next = (struct fib *) getmem (size);
+	assert (g_fwd->next);
+	memset(g_fwd->next, 0, size);
+	g_fwd->next->cap = cap;
+}
+
+void fib_set(node d, int *sd, unsigned int n) {
+	struct fib_entry *e;
+
+	if (d >= g_fwd->next->cap)
+		return;
+	e = &g_fwd->next->e[d];
+	e->n = n < RT_ECMP ? n : RT_ECMP;
+	memcpy(e->sd, sd, e->n * sizeof(int));
+}
+
+/* free what every reader has moved past */
+static void fib_reclaim() {
+	unsigned long oldest = ULONG_MAX;
+	struct fib **p, *f;
+	unsigned int i;
+
+	for (i = 0; i < FWD_READERS; i++) {
+		unsigned long e = __atomic_load_n(&g_fwd->reader[i], __ATOMIC_SEQ_CST);
+
+		if (e && e < oldest)
+			oldest = e;
+	}
+	// a reader that entered in epoch e may hold what was retired in e or later
+	for (p = &g_fwd->retired; (f = *p); ) {
+		if (f->epoch < oldest) {
+			*p = f->retired;
+			free(f);
+			g_fwd->reclaimed++;
+		} else {
+			p = &f->retired;
+		}
+	}
+}
+
+void fib_publish() {
+	struct fib *old;
+
+	assert (g_fwd->next);
+	old = __atomic_exchange_n(&g_fwd->fib, g_fwd->next, __ATOMIC_SEQ_CST);
+	g_fwd->next = 0x0;
+	g_fwd->published++;
+	if (old) {
+		old->epoch = g_fwd->epoch;
+		old->retired = g_fwd->retired;
+		g_fwd->retired = old;
+	}
+	// whoever enters from here on cannot find old
+	__atomic_add_fetch(&g_fwd->epoch, 1, __ATOMIC_SEQ_CST);
+	fib_reclaim();
+}
+
+struct fib *fib_enter() {
+	if (fwd_slot < 0) {
+		fwd_slot = __atomic_fetch_add(&fwd_threads, 1, __ATOMIC_SEQ_CST);
+		assert (fwd_slot < FWD_READERS);
+	}
+	__atomic_store_n(&g_fwd->reader[fwd_slot],
+		__atomic_load_n(&g_fwd->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&g_fwd->fib, __ATOMIC_SEQ_CST);
+}
+
+void fib_exit() {
+	__atomic_store_n(&g_fwd->reader[fwd_slot], 0, __ATOMIC_RELEASE);
+}
+
+/* mixed as in pick_rte, so a flow takes the hop the table would give it */
+static uint32_t fwd_hash(uint32_t flow) {
+	flow ^= flow >> 16;
+	flow *= 0x45d9f3b;
+	flow ^= flow >> 16;
+	return flow;
+}
+
+int fib_hop(struct fib *f, node d, uint32_t flow) {
+	struct fib_entry *e;
+
+	if (!f || d >= f->cap || !(e = &f->e[d])->n)
+		return -1;
+	return e->n == 1 ? e->sd[0] : e->sd[fwd_hash(flow) % e->n];
+}
+
+/* send everything queued, one sendmmsg per socket */
+static void fwd_flush() {
+	struct mmsghdr msgs[FWD_BATCH];
+	size_t i, j, n;
+	int sent;
+
+	for (i = 0; i < q_len; i++) {
+		int sd = q_sd[i];
+
+		if (sd < 0)
+			continue;
+		memset(msgs, 0, sizeof(msgs));
+		for (j = i, n = 0; j < q_len; j++) {
+			if (q_sd[j] != sd)
+				continue;
+			msgs[n].msg_hdr.msg_iov = &q_iov[j];
+			msgs[n++].msg_hdr.msg_iovlen = 1;
+			q_sd[j] = -1;
+		}
+		// what the socket will not take is dropped, as a queue would
+		if ((sent = sendmmsg(sd, msgs, n, MSG_DONTWAIT)) > 0)
+			g_fwd->tx += sent;
+	}
+	q_len = 0;
+}
+
+/* false if buf is not a data packet */
+static bool fwd_input(struct fib *f, uint8_t *buf, size_t len) {
+	uint32_t dst, flow;
+	int sd;
+
+	if (len < FWD_HDR || buf[0] != FWD_TYPE)
+		return false;
+	g_fwd->rx++;
+	if (buf[1] != FWD_VERSION)
+		return true;
+	memcpy(&dst, buf + 4, 4);
+	dst = ntohl(dst);
+	if (dst == g_fwd->me) {
+		g_fwd->delivered++;
+		return true;
+	}
+	if (buf[2] <= 1) {
+		g_fwd->expired++;
+		return true;
+	}
+	memcpy(&flow, buf + 8, 4);
+	if ((sd = fib_hop(f, dst, ntohl(flow))) < 0) {
+		g_fwd->no_route++;
+		return true;
+	}
+	buf[2]--;
+	q_sd[q_len] = sd;
+	q_iov[q_len].iov_base = buf;
+	q_iov[q_len++].iov_len = len;
+	return true;
+}
+
+size_t fwd_drain(struct link *l, int sd, fwd_ctl_fn ctl, uint64_t now) {
+	struct fib *f;
+	size_t total = 0;
+	unsigned int batch = fwd_batch < 1 ? 1 : fwd_batch > FWD_BATCH ? FWD_BATCH : fwd_batch;
+	int n, i;
+
+	if (!rx) {
+		rx = (uint8_t *) malloc ((size_t)FWD_BATCH * FWD_MAXDGRAM);
+		assert (rx);
+	}
+	for (;;) {
+		for (i = 0; i < (int)batch; i++) {
+			rx_iov[i].iov_base = rx + (size_t)i * FWD_MAXDGRAM;
+			rx_iov[i].iov_len = FWD_MAXDGRAM;
+			memset(&rx_msg[i].msg_hdr, 0, sizeof(struct msghdr));
+			rx_msg[i].msg_hdr.msg_iov = &rx_iov[i];
+			rx_msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(sd, rx_msg, batch, MSG_DONTWAIT, 0x0);
+		if (n < 0) {
+			// ECONNREFUSED only means the peer was not up yet
+			if (errno == ECONNREFUSED)
+				continue;
+			break;
+		}
+		// the whole batch is looked up in one snapshot
+		f = fib_enter();
+		for (i = 0; i < n; i++) {
+			uint8_t *buf = rx_iov[i].iov_base;
+
+			if (!fwd_input(f, buf, rx_msg[i].msg_len) && ctl)
+				ctl(l, buf, rx_msg[i].msg_len, now);
+		}
+		fib_exit();
+		fwd_flush();
+		total += n;
+	}
+	return total;
+}
+
+void fwd_print(int set) {
+	printf("[fwd] set=%d node=%u rx=%lu tx=%lu delivered=%lu no_route=%lu expired=%lu\n",
+		set, g_fwd->me, g_fwd->rx, g_fwd->tx, g_fwd->delivered,
+		g_fwd->no_route, g_fwd->expired);
+}
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * Scenario generator, writes an ru config to stdout
+ *
+ *   gen -t ring|grid|waxman|ba|fattree [-n nodes] [-k degree] [-p beta]
+ *       [-s seed] [-C max_cost] [-e churn_sets] [-c churn_events]
+ *       [-h hostname]
+ *
+ *   ring     n nodes in a cycle
+ *   grid     n nodes in a near-square mesh
+ *   waxman   n nodes in the unit square, n*k/2 links, a link of length d
+ *            kept with probability exp(-d / (beta * sqrt 2)); nodes that
+ *            draw no link stay unreachable, as in the model
+ *   ba       Barabasi-Albert, every new node attaches to k/2 others in
+ *            proportion to their degree
+ *   fattree  k-ary fat tree of 5k^2/4 switches, -n is ignored
+ *
+ * The first event set establishes every link with a cost in 1..max_cost.
+ * Each churn set after it tears down, updates or restores churn_events
+ * distinct links picked with the seeded generator, so the same arguments
+ * always give the same file. Ports are unique while there are fewer than
+ * 32000 links; bigger scenarios are meant for sim.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "common.h"
+
+static uint64_t rng;
+
+static uint64_t splitmix64() {
+	uint64_t z = (rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* uniform in [0, n) */
+static uint64_t rnd(uint64_t n) {
+	return splitmix64() % n;
+}
+
+static double rnd01() {
+	return (splitmix64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* links, with an open addressing set of node pairs to reject duplicates */
+static node *eu, *ev;
+static cost *ec;
+static size_t ne, ecap;
+static uint64_t *eset;
+static size_t esize;
+
+static bool add_edge(node u, node v) {
+	uint64_t key, h;
+	size_t i;
+
+	if (u == v)
+		return false;
+	if (u > v) {
+		node t = u; u = v; v = t;
+	}
+	if (2 * (ne + 1) > esize) {
+		uint64_t *old = eset;
+		size_t oldsize = esize, j;
+
+		esize = esize ? esize * 2 : 1024;
+		eset = (uint64_t *) calloc (esize, sizeof(uint64_t));
+		if (!eset) {
+			perror("calloc");
+			exit(1);
+		}
+		for (j = 0; j < oldsize; j++) {
+			if (!old[j])
+				continue;
+			h = old[j] * 0x9e3779b97f4a7c15ULL;
+			for (i = h & (esize - 1); eset[i]; i = (i + 1) & (esize - 1))
+				;
+			eset[i] = old[j];
+		}
+		free(old);
+	}
+	key = ((uint64_t)u << 32 | v) + 1;
+	h = key * 0x9e3779b97f4a7c15ULL;
+	for (i = h & (esize - 1); eset[i]; i = (i + 1) & (esize - 1))
+		if (eset[i] == key)
+			return false;
+	eset[i] = key;
+
+	if (ne == ecap) {
+		ecap = ecap ? ecap * 2 : 1024;
+		eu = (node *) realloc (eu, ecap * sizeof(node));
+		ev = (node *) realloc (ev, ecap * sizeof(node));
+		if (!eu || !ev) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	eu[ne] = u;
+	ev[ne] = v;
+	ne++;
+	return true;
+}
+
+static void gen_ring(node n) {
+	node i;
+
+	for (i = 0; i < n; i++)
+		add_edge(i, (i + 1) % n);
+}
+
+static void gen_grid(node n) {
+	node rows = (node)sqrt(n), cols, i;
+
+	if (!rows)
+		rows = 1;
+	cols = (n + rows - 1) / rows;
+	for (i = 0; i < n; i++) {
+		if ((i + 1) % cols && i + 1 < n)
+			add_edge(i, i + 1);
+		if (i + cols < n)
+			add_edge(i, i + cols);
+	}
+}
+
+static void gen_waxman(node n, unsigned int k, double beta) {
+	double *x = (double *) malloc (n * sizeof(double));
+	double *y = (double *) malloc (n * sizeof(double));
+	size_t want = (size_t)n * k / 2, tries = 0;
+	node i;
+
+	if (!x || !y) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		x[i] = rnd01();
+		y[i] = rnd01();
+	}
+	// draw pairs and keep them with the Waxman probability until enough stick
+	while (ne < want && n > 1) {
+		node u = rnd(n), v = rnd(n);
+		double d = hypot(x[u] - x[v], y[u] - y[v]);
+
+		if (++tries > 1000 * want) {
+			fprintf(stderr, "waxman: gave up after %zu links\n", ne);
+			break;
+		}
+		if (u != v && rnd01() < exp(-d / (beta * M_SQRT2)))
+			add_edge(u, v);
+	}
+	free(x);
+	free(y);
+}
+
+static void gen_ba(node n, unsigned int k) {
+	// every link end once, so a uniform pick is proportional to degree
+	node *ends = (node *) malloc ((size_t)n * k * sizeof(node) + sizeof(node));
+	size_t nends = 0;
+	node m = k / 2 ? k / 2 : 1, i, j;
+
+	if (!ends) {
+		perror("malloc");
+		exit(1);
+	}
+	// start from a clique of m + 1 nodes
+	for (i = 0; i <= m && i < n; i++)
+		for (j = 0; j < i; j++)
+			if (add_edge(i, j)) {
+				ends[nends++] = i;
+				ends[nends++] = j;
+			}
+	for (; i < n; i++) {
+		node got = 0;
+
+		while (got < m) {
+			j = ends[rnd(nends)];
+			if (add_edge(i, j)) {
+				ends[nends++] = i;
+				ends[nends++] = j;
+				got++;
+			}
+		}
+	}
+	free(ends);
+}
+
+/*
+ * Switches are numbered core first, then per pod its aggregation and
+ * edge switches. Aggregation switch a of every pod goes to core switches
+ * a*k/2 .. a*k/2 + k/2 - 1.
+ */
+static node gen_fattree(unsigned int k) {
+	node h = k / 2, core = h * h, pod, a, e, c;
+
+	for (pod = 0; pod < k; pod++) {
+		node agg = core + pod * k, edge = agg + h;
+
+		for (a = 0; a < h; a++) {
+			for (c = 0; c < h; c++)
+				add_edge(a * h + c, agg + a);
+			for (e = 0; e < h; e++)
+				add_edge(agg + a, edge + e);
+		}
+	}
+	return core + k * k;
+}
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s -t ring|grid|waxman|ba|fattree [-n nodes] [-k degree] "
+		"[-p beta] [-s seed] [-C max_cost] [-e churn_sets] [-c churn_events] "
+		"[-h hostname]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	char *type = 0x0, *host = "localhost";
+	node n = 16, i;
+	unsigned int k = 4, max_cost = 20, sets = 0, churn = 0, s;
+	uint64_t seed = 1;
+	double beta = 0.2;
+	bool *down;
+	unsigned int *mark;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:n:k:p:s:C:e:c:h:")) != -1) {
+		switch (opt) {
+			case 't': type = optarg; break;
+			case 'n': n = strtoul(optarg, 0x0, 10); break;
+			case 'k': k = atoi(optarg); break;
+			case 'p': beta = atof(optarg); break;
+			case 's': seed = strtoull(optarg, 0x0, 10); break;
+			case 'C': max_cost = atoi(optarg); break;
+			case 'e': sets = atoi(optarg); break;
+			case 'c': churn = atoi(optarg); break;
+			case 'h': host = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (!type || optind != argc || !n || !k || !max_cost || beta <= 0)
+		usage(argv[0]);
+	rng = seed;
+
+	if (!strcmp(type, "ring"))
+		gen_ring(n);
+	else if (!strcmp(type, "grid"))
+		gen_grid(n);
+	else if (!strcmp(type, "waxman"))
+		gen_waxman(n, k, beta);
+	else if (!strcmp(type, "ba"))
+		gen_ba(n, k);
+	else if (!strcmp(type, "fattree") && k % 2 == 0)
+		n = gen_fattree(k);
+	else
+		usage(argv[0]);
+
+	ec = (cost *) malloc ((ne + 1) * sizeof(cost));
+	down = (bool *) calloc (ne + 1, sizeof(bool));
+	mark = (unsigned int *) calloc (ne + 1, sizeof(unsigned int));
+	if (!ec || !down || !mark) {
+		perror("malloc");
+		exit(1);
+	}
+	if (!churn)
+		churn = ne / 100 ? ne / 100 : 1;
+	if (churn > ne)
+		churn = ne;
+
+	setvbuf(stdout, 0x0, _IOFBF, 1 << 20);
+	printf("; %s, %u nodes, %zu links, seed %llu\n", type, n, ne,
+		(unsigned long long)seed);
+	for (i = 0; i < n; i++)
+		printf("node %u %s\n", i, host);
+
+	printf("(\n");
+	for (i = 0; i < ne; i++) {
+		ec[i] = 1 + rnd(max_cost);
+		printf("establish node %u port %zu node %u port %zu cost %u name L%u\n",
+			eu[i], 1024 + (2 * (size_t)i) % 64000, ev[i],
+			1024 + (2 * (size_t)i + 1) % 64000, ec[i], i);
+	}
+	printf(")\n");
+
+	for (s = 1; s <= sets; s++) {
+		unsigned int done = 0;
+
+		printf("(\n");
+		while (done < churn) {
+			node l = rnd(ne);
+
+			// touch a link at most once per set
+			if (mark[l] == s)
+				continue;
+			mark[l] = s;
+			done++;
+			if (down[l]) {
+				down[l] = false;
+				printf("establish node %u port %zu node %u port %zu cost %u name L%u\n",
+					eu[l], 1024 + (2 * (size_t)l) % 64000, ev[l],
+					1024 + (2 * (size_t)l + 1) % 64000, ec[l], l);
+			} else if (rnd(2)) {
+				down[l] = true;
+				printf("tear-down L%u\n", l);
+			} else {
+				ec[l] = 1 + rnd(max_cost);
+				printf("update L%u cost %u\n", l, ec[l]);
+			}
+		}
+		printf(")\n");
+	}
+	return 0;
+}
@@ -0,0 +1,56 @@
+/* $Id$
+ * Interned link names
+ */
+
+#ifndef _INTERN_C_
+#define _INTERN_C_
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+#include "intern.h"
+#include "arena.h"
+
+static struct iname *g_names = 0x0;
+static struct arena names;
+
+/*
+ * Return the record for <s>, or 0x0 if the name was never interned
+ */
+struct iname *find_iname(char *s) {
+	struct iname *i;
+
+	assert(s);
+	HASH_FIND_STR(g_names, s, i);
+	return i;
+}
+
+/*
+ * Return the shared copy of <s>, making one the first time it is seen
+ */
+char *intern(char *s) {
+	struct iname *i = find_iname(s);
+	size_t len;
+
+	if (i)
+		return i->s;
+	len = strlen(s);
+	i = (struct iname *)arena_alloc(&names, sizeof(struct iname) + len + 1);
+	i->link = 0x0;
+	i->local = false;
+	memcpy(i->s, s, len + 1);
+	HASH_ADD_KEYPTR(hh, g_names, i->s, len, i);
+	return i->s;
+}
+
+/*
+ * Forget every name at once, every string intern() handed out goes too
+ */
+void free_names() {
+	HASH_CLEAR(hh, g_names);
+	arena_free(&names);
+}
+
+#endif
@@ -9,15 +9,39 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include "common.h"
 #include "ls.h"
 #include "queue.h"
 #include "n2h.h"
 #include "rt.h"
+#include "intern.h"
+#include "arena.h"
+
+struct link *g_ls;
+bool ls_bind_ports = true;
+int g_ls_epfd = -1;
+unsigned long ls_gen;
+
+/*
+ * Links of every link set come out of one arena; torn down links wait on
+ * a free list for the next establish
+ */
+static struct arena links;
+static struct link *free_links;
 
 int create_ls() {
 	InitDQ(g_ls, struct link);
 	assert (g_ls);
+
+	if (ls_bind_ports && g_ls_epfd < 0) {
+		g_ls_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (g_ls_epfd < 0) {
+			perror("epoll_create1() failed");
+			exit(1);
+		}
+	}
   
 	g_ls->peer0 =  g_ls->peer1 = g_ls ->c = -1;
 	g_ls->name = 0x0;
@@ -25,26 +49,68 @@ int create_ls() {
 	return (g_ls != 0x0);
 }
 
+/* have epoll report datagrams on sd as input to l */
+static void ls_watch(struct link *l, int sd) {
+	struct epoll_event ev;
+
+	if (sd < 0)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = l;
+	if (epoll_ctl(g_ls_epfd, EPOLL_CTL_ADD, sd, &ev) < 0)
+		perror("epoll_ctl() failed");
+}
+
+/* unregister and close one end */
+static void ls_close(int sd) {
+	if (sd < 0)
+		return;
+	epoll_ctl(g_ls_epfd, EPOLL_CTL_DEL, sd, 0x0);
+	close(sd);
+}
+
 int add_link(node peer0, int port0, node peer1, int port1, cost c, char *name) {
-	struct link *nl = (struct link *)getmem(sizeof(struct link));
+	struct link *nl = free_links;
+
+	if (nl)
+		free_links = nl->next;
+	else
+		nl = (struct link *)arena_alloc(&links, sizeof(struct link));
 	nl->peer0 = peer0;
 	nl->port0 = port0;
 	nl->peer1 = peer1;
 	nl->port1 = port1;
 	nl->c = c;
-	nl->name = (char *)malloc(strlen(name)+1);
-	strcpy(nl->name, name);
-
-	if (peer0 == get_myid())
+	nl->name = intern(name);
+	nl->vec = 0x0;
+	nl->prot = 0x0;
+	nl->nprot = nl->prot_cap = 0;
+	nl->pend = 0x0;
+	nl->trig_at = 0;
+	nl->trig.next = 0x0;
+	nl->pen = 0;
+	nl->pen_at = 0;
+	nl->damped = false;
+	nl->reuse.next = 0x0;
+	nl->adj = false;
+	nl->timeout.next = 0x0;
+	memset(&nl->bfd, 0, sizeof(struct bfd));
+	find_iname(nl->name)->link = nl;
+
+	if (peer0 == get_myid() && ls_bind_ports)
 	 	nl->sockfd0 = bind_port(port0);
 	else
 	   	nl->sockfd0 = -1;
-	if (peer1 == get_myid())
+	if (peer1 == get_myid() && ls_bind_ports)
 	 	nl->sockfd1 = bind_port(port1);
 	else
    		nl->sockfd1 = -1;
+	ls_watch(nl, nl->sockfd0);
+	ls_watch(nl, nl->sockfd1);
 
 	InsertDQ(g_ls, nl);
+	ls_gen++;
 	return (nl != 0x0);
 }
 
@@ -54,34 +120,68 @@ struct link *ud_link(char *n, int cost) {
 
 	assert(i);
 	i->c = cost;
+	ls_gen++;
 	return i;
 }
 
 
 struct link *find_link(char *n) {
-	struct link *i;
-	for (i = g_ls->next; i != g_ls; i= i->next) {
-		if (!(strcmp(i->name, n))) {
-			break;
-		}
-	}
-	if (!strcmp(i->name, n)) {
-		return i;
-	} else {
-		return 0x0;
-	}
+	struct iname *i = find_iname(n);
+
+	return i ? i->link : 0x0;
 }
 
 int del_link(char *name) {
 	struct link *i = find_link(name);
 	assert (i);
 	DelDQ(i);
-	free(i->name);
-	free(i);
+	find_iname(i->name)->link = 0x0;
+	ls_close(i->sockfd0);
+	ls_close(i->sockfd1);
+	free(i->vec);
+	free(i->prot);
+	free(i->pend);
+	i->next = free_links;
+	ls_gen++;
+	free_links = i;
 	return 0x0;
 }
 
 
+/*
+ * Close and drop every link of the current link set, and the set itself.
+ * The links go on the free list; their memory stays in the arena until
+ * release_links.
+ */
+void free_ls() {
+	struct link *i, *next;
+
+	if (!g_ls)
+		return;
+	for (i = g_ls->next; i != g_ls; i = next) {
+		next = i->next;
+		find_iname(i->name)->link = 0x0;
+		ls_close(i->sockfd0);
+		ls_close(i->sockfd1);
+		free(i->vec);
+		free(i->prot);
+		free(i->pend);
+		i->next = free_links;
+		free_links = i;
+	}
+	free(g_ls);
+	g_ls = 0x0;
+	ls_gen++;
+}
+
+/*
+ * Release the links of every link set, once free_ls has dropped them all
+ */
+void release_links() {
+	arena_free(&links);
+	free_links = 0x0;
+}
+
 void print_link(struct link* i) {
 	fprintf (stdout, "[ls]\t ----- link name(%s) ----- \n", i->name);
 	fprintf (stdout, "[ls]\t node(%d)host(%s)port(%d) <--> node(%d)host(%s)port(%d)\n",
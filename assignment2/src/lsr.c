@@ -0,0 +1,680 @@
+/* $Id$
+ * Link-state routing
+ *
+ * Every router floods an LSA naming its neighbors and what each link to
+ * them costs, numbered so that a newer one replaces an older one. Each
+ * router keeps the latest LSA of every origin and computes a shortest
+ * path tree rooted at itself over them, which fills g_rt.
+ *
+ * An LSA is flooded on every adjacency but the one it came in on. The
+ * first time a neighbor is heard from, and again after it went silent,
+ * it is sent the whole database. Hellos are my own LSA again, sent to
+ * the neighbors only, so they keep adjacencies from timing out without
+ * flooding anything. A router that hears its own LSA with a newer number
+ * than it remembers (it restarted) takes the number over and originates
+ * past it.
+ *
+ * SPF is incremental where that is easy: edges that appeared or got
+ * cheaper are relaxed from where they start, which is all a topology
+ * coming up ever needs. If an edge of the current tree got worse or went
+ * away the tree is computed again from scratch.
+ */
+#ifndef _LSR_C_
+#define _LSR_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "queue.h"
+#include "dv.h"
+#include "ls.h"
+#include "rt.h"
+#include "lsr.h"
+
+#define NOT_HEAPED ((uint32_t)-1)
+
+/*
+ * Scratch space. Only one router runs at a time, even in the simulator,
+ * so all of them share it.
+ */
+static node *rx_to;             // the LSA being parsed
+static cost *rx_c;
+static size_t rx_cap;
+static node *heap;              // d-ary heap of nodes keyed by dist
+static uint32_t *pos;           // where each node sits in it
+static size_t heap_len, heap_cap;
+static node *touched;           // nodes whose distance or hops a run changed
+static uint64_t *marked;        // bit set if the node is in touched
+static size_t ntouched;
+static uint8_t *tx;             // datagrams being built for one link
+static size_t tx_len, tx_cap;
+static size_t *dgram;           // where each one starts
+static size_t ndgram, dgram_cap;
+static struct iovec *iov;
+static size_t iov_cap;
+
+static void *grow(void *p, size_t *cap, size_t want, size_t size) {
+	if (want <= *cap)
+		return p;
+	while (*cap < want)
+		*cap = *cap ? *cap * 2 : 64;
+	p = realloc (p, *cap * size);
+	assert (p);
+	return p;
+}
+
+static void lsr_scratch(node cap) {
+	size_t old = heap_cap;
+
+	if (cap <= heap_cap)
+		return;
+	heap = (node *) grow (heap, &heap_cap, cap, sizeof(node));
+	pos = (uint32_t *) realloc (pos, heap_cap * sizeof(uint32_t));
+	touched = (node *) realloc (touched, heap_cap * sizeof(node));
+	marked = (uint64_t *) realloc (marked, (heap_cap / 64 + 1) * sizeof(uint64_t));
+	assert (pos && touched && marked);
+	memset(pos + old, 0xff, (heap_cap - old) * sizeof(uint32_t));
+	memset(marked, 0, (heap_cap / 64 + 1) * sizeof(uint64_t));
+}
+
+struct lsr *lsr_init() {
+	struct lsr *s = (struct lsr *) getmem (sizeof(struct lsr));
+	node d;
+
+	assert (s);
+	memset(s, 0, sizeof(struct lsr));
+	s->cap = g_dv->cap;
+	s->db = (struct lsa *) calloc (s->cap, sizeof(struct lsa));
+	s->dist = (cost *) malloc (s->cap * sizeof(cost));
+	s->parent = (node *) malloc (s->cap * sizeof(node));
+	s->paths = rt_max_paths;
+	s->hop = (node *) malloc ((size_t)s->cap * s->paths * sizeof(node));
+	s->nhop = (uint8_t *) calloc (s->cap, 1);
+	s->queued = (uint64_t *) calloc (s->cap / 64 + 1, sizeof(uint64_t));
+	assert (s->db && s->dist && s->parent && s->hop && s->nhop && s->queued);
+	for (d = 0; d < s->cap; d++) {
+		s->dist[d] = INF_COST;
+		s->parent[d] = NO_NODE;
+	}
+	if (g_dv->me < s->cap)
+		s->dist[g_dv->me] = 0;
+	lsr_scratch(s->cap);
+	return s;
+}
+
+/*
+ * -------------------------------------
+ * Database
+ * -------------------------------------
+ */
+
+/* pack every row back to back again once half the arrays are holes */
+static void lsr_compact(struct lsr *s) {
+	node *to = (node *) malloc ((s->edges - s->holes + 1) * sizeof(node));
+	cost *c = (cost *) malloc ((s->edges - s->holes + 1) * sizeof(cost));
+	size_t e = 0;
+	node u;
+
+	assert (to && c);
+	for (u = 0; u < s->cap; u++) {
+		struct lsa *a = &s->db[u];
+
+		if (!a->room)
+			continue;
+		memcpy(to + e, s->to + a->off, a->n * sizeof(node));
+		memcpy(c + e, s->c + a->off, a->n * sizeof(cost));
+		a->off = e;
+		e += a->room;
+	}
+	free(s->to);
+	free(s->c);
+	s->to = to;
+	s->c = c;
+	s->edges = s->edges_cap = e;
+	s->holes = 0;
+}
+
+static void lsr_store(struct lsr *s, node u, uint32_t n, node *to, cost *c) {
+	struct lsa *a = &s->db[u];
+
+	if (n > a->room) {
+		// rows usually grow a link at a time, leave them some slack
+		size_t room = n + n / 4 + 1;
+
+		s->holes += a->room;
+		a->room = 0;
+		if (s->holes > 1024 && s->holes > s->edges / 2)
+			lsr_compact(s);
+		// to and c both hold edges_cap entries, so they grow together
+		if (s->edges + room > s->edges_cap) {
+			s->to = (node *) grow (s->to, &s->edges_cap, s->edges + room, sizeof(node));
+			s->c = (cost *) realloc (s->c, s->edges_cap * sizeof(cost));
+			assert (s->c);
+		}
+		a->off = s->edges;
+		a->room = room;
+		s->edges += room;
+	}
+	memcpy(s->to + a->off, to, n * sizeof(node));
+	memcpy(s->c + a->off, c, n * sizeof(cost));
+	a->n = n;
+}
+
+/* cost of edge u -> v in the database, INF_COST if there is none */
+static cost lsr_edge(struct lsr *s, node u, node v) {
+	struct lsa *a = &s->db[u];
+	node *to = s->to + a->off;
+	uint32_t lo = 0, hi = a->n;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+
+		if (to[mid] < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < a->n && to[lo] == v ? s->c[a->off + lo] : INF_COST;
+}
+
+static void lsr_seed(struct lsr *s, node u, node v) {
+	s->seeds = (struct lsr_seed *) grow (s->seeds, &s->seeds_cap, s->nseeds + 1,
+		sizeof(struct lsr_seed));
+	s->seeds[s->nseeds].u = u;
+	s->seeds[s->nseeds].v = v;
+	s->nseeds++;
+}
+
+/* is u's edge of cost c to v on a shortest path to v, one of several maybe */
+static bool lsr_on_tree(struct lsr *s, node u, node v, cost c) {
+	if (s->paths == 1)
+		return s->parent[v] == u;
+	return s->dist[u] != INF_COST && s->dist[u] + c == s->dist[v];
+}
+
+/*
+ * What replacing u's row with the sorted (to, c) does to the tree: new
+ * and cheaper edges are seeds for the next run, a tree edge that got
+ * worse or went away means starting over
+ */
+static void lsr_diff(struct lsr *s, node u, uint32_t n, node *to, cost *c) {
+	struct lsa *a = &s->db[u];
+	node *oto = s->to + a->off;
+	cost *oc = s->c + a->off;
+	uint32_t i = 0, j = 0;
+
+	s->spf = true;
+	while (!s->full && (i < a->n || j < n)) {
+		if (j == n || (i < a->n && oto[i] < to[j])) {
+			if (lsr_on_tree(s, u, oto[i], oc[i]))
+				s->full = true;
+			i++;
+		} else if (i == a->n || to[j] < oto[i]) {
+			lsr_seed(s, u, to[j]);
+			j++;
+		} else {
+			if (c[j] > oc[i] && lsr_on_tree(s, u, to[j], oc[i]))
+				s->full = true;
+			else if (c[j] < oc[i])
+				lsr_seed(s, u, to[j]);
+			i++;
+			j++;
+		}
+	}
+	if (s->full)
+		s->nseeds = 0;
+}
+
+static void lsr_queue(struct lsr *s, node u, struct link *from) {
+	if (s->queued[u >> 6] >> (u & 63) & 1)
+		return;
+	s->queued[u >> 6] |= 1ULL << (u & 63);
+	s->fq = (node *) grow (s->fq, &s->fq_cap, s->fq_len + 1, sizeof(node));
+	s->fq_from = (struct link **) realloc (s->fq_from, s->fq_cap * sizeof(struct link *));
+	assert (s->fq_from);
+	s->fq[s->fq_len] = u;
+	s->fq_from[s->fq_len++] = from;
+	g_dv->dirty = true;
+}
+
+/* install a newer LSA of u and pass it on to everyone but <from> */
+static void lsr_install(struct lsr *s, node u, uint32_t seq, uint32_t n,
+	node *to, cost *c, struct link *from) {
+	if (!s->full)
+		lsr_diff(s, u, n, to, c);
+	lsr_store(s, u, n, to, c);
+	s->db[u].seq = seq;
+	lsr_queue(s, u, from);
+}
+
+static int by_pair(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * My LSA lists every adjacency that is alive with its cost, the cheapest
+ * one if there are parallel links. <seq> is what it was last numbered, which is more
+ * than I remember after a restart.
+ */
+static void lsr_originate_seq(uint32_t seq, bool force) {
+	struct lsr *s = g_dv->lsr;
+	struct lsa *a = &s->db[g_dv->me];
+	struct link *l;
+	size_t n = 0, i, k;
+
+	for (l = g_ls->next; l != g_ls; l = l->next)
+		if (l->adj && bfd_alive(l))
+			n++;
+	rx_to = (node *) grow (rx_to, &rx_cap, n + 1, sizeof(node));
+	rx_c = (cost *) realloc (rx_c, rx_cap * sizeof(cost));
+	assert (rx_c);
+	// sort (peer, cost) pairs packed in one word, then keep the cheapest
+	{
+		uint64_t *pairs = (uint64_t *) malloc ((n + 1) * sizeof(uint64_t));
+
+		assert (pairs);
+		n = 0;
+		for (l = g_ls->next; l != g_ls; l = l->next)
+			if (l->adj && bfd_alive(l) && dv_peer(l) < s->cap)
+				pairs[n++] = (uint64_t)dv_peer(l) << 32 | l->c;
+		qsort(pairs, n, sizeof(uint64_t), by_pair);
+		for (i = k = 0; i < n; i++) {
+			if (k && rx_to[k - 1] == (node)(pairs[i] >> 32))
+				continue;
+			rx_to[k] = pairs[i] >> 32;
+			rx_c[k++] = (cost)pairs[i];
+		}
+		free(pairs);
+	}
+
+	if (!force && a->seq && a->n == k &&
+	    !memcmp(s->to + a->off, rx_to, k * sizeof(node)) &&
+	    !memcmp(s->c + a->off, rx_c, k * sizeof(cost)))
+		return;
+	lsr_install(s, g_dv->me, seq + 1, k, rx_to, rx_c, 0x0);
+}
+
+void lsr_originate() {
+	lsr_originate_seq(g_dv->lsr->db[g_dv->me].seq, false);
+}
+
+void lsr_neighbor_up(struct link *l) {
+	l->synced = false;
+	l->dump = false;
+}
+
+/* it gets the whole database again once it is back */
+void lsr_neighbor_down(struct link *l) {
+	l->synced = false;
+}
+
+/*
+ * -------------------------------------
+ * Shortest paths
+ * -------------------------------------
+ */
+
+static void heap_up(cost *dist, size_t i) {
+	node v = heap[i];
+
+	while (i) {
+		size_t up = (i - 1) / LSR_D;
+
+		if (dist[heap[up]] <= dist[v])
+			break;
+		heap[i] = heap[up];
+		pos[heap[i]] = i;
+		i = up;
+	}
+	heap[i] = v;
+	pos[v] = i;
+}
+
+static void heap_down(cost *dist, size_t i) {
+	node v = heap[i];
+
+	for (;;) {
+		size_t first = i * LSR_D + 1, best = first, k;
+
+		if (first >= heap_len)
+			break;
+		for (k = first + 1; k < first + LSR_D && k < heap_len; k++)
+			if (dist[heap[k]] < dist[heap[best]])
+				best = k;
+		if (dist[heap[best]] >= dist[v])
+			break;
+		heap[i] = heap[best];
+		pos[heap[i]] = i;
+		i = best;
+	}
+	heap[i] = v;
+	pos[v] = i;
+}
+
+/* v got closer: into the heap, or up it */
+static void heap_push(cost *dist, node v) {
+	if (pos[v] == NOT_HEAPED) {
+		heap[heap_len] = v;
+		heap_up(dist, heap_len++);
+	} else {
+		heap_up(dist, pos[v]);
+	}
+}
+
+static node heap_pop(cost *dist) {
+	node v = heap[0];
+
+	pos[v] = NOT_HEAPED;
+	if (--heap_len) {
+		heap[0] = heap[heap_len];
+		heap_down(dist, 0);
+	}
+	return v;
+}
+
+/* v can also be reached through u's first hops, false if none were new */
+static bool lsr_merge(struct lsr *s, node u, node v) {
+	node *hv = s->hop + (size_t)v * s->paths, *hu = s->hop + (size_t)u * s->paths;
+	unsigned int nu = s->nhop[u], i, j;
+	bool grew = false;
+
+	if (u == g_dv->me) {
+		hu = &v;
+		nu = 1;
+	}
+	for (i = 0; i < nu && s->nhop[v] < s->paths; i++) {
+		for (j = 0; j < s->nhop[v] && hv[j] != hu[i]; j++)
+			;
+		if (j == s->nhop[v]) {
+			hv[s->nhop[v]++] = hu[i];
+			grew = true;
+		}
+	}
+	return grew;
+}
+
+static void lsr_relax(struct lsr *s, node u, node v, cost c) {
+	cost d = s->dist[u] + c;
+
+	if (d < s->dist[u] || d > s->dist[v])
+		return;
+	if (d == s->dist[v]) {
+		// an equally short path: v, and everything past it, may gain hops
+		if (s->paths == 1 || !lsr_merge(s, u, v))
+			return;
+	} else {
+		s->dist[v] = d;
+		s->parent[v] = u;
+		s->nhop[v] = 0;
+		lsr_merge(s, u, v);
+	}
+	if (!(marked[v >> 6] >> (v & 63) & 1)) {
+		marked[v >> 6] |= 1ULL << (v & 63);
+		touched[ntouched++] = v;
+	}
+	heap_push(s->dist, v);
+}
+
+static void lsr_spf(struct lsr *s, uint64_t now) {
+	node me = g_dv->me, u, v;
+	size_t i;
+
+	ntouched = 0;
+	if (s->full) {
+		for (v = 0; v < s->cap; v++) {
+			s->dist[v] = INF_COST;
+			s->parent[v] = NO_NODE;
+			s->nhop[v] = 0;
+		}
+		s->dist[me] = 0;
+		s->full_runs++;
+	}
+	s->runs++;
+
+	if (s->full) {
+		heap_push(s->dist, me);
+	} else {
+		for (i = 0; i < s->nseeds; i++) {
+			u = s->seeds[i].u;
+			v = s->seeds[i].v;
+			// the row may have changed again since the seed was planted
+			if (s->dist[u] != INF_COST)
+				lsr_relax(s, u, v, lsr_edge(s, u, v));
+		}
+	}
+	while (heap_len) {
+		struct lsa *a;
+		uint32_t k;
+
+		u = heap_pop(s->dist);
+		a = &s->db[u];
+		for (k = 0; k < a->n; k++)
+			lsr_relax(s, u, s->to[a->off + k], s->c[a->off + k]);
+	}
+	s->nseeds = 0;
+	s->spf = false;
+	for (i = 0; i < ntouched; i++)
+		marked[touched[i] >> 6] &= ~(1ULL << (touched[i] & 63));
+
+	// hand what moved to the routing table
+	for (i = 0; i < (s->full ? s->cap : ntouched); i++) {
+		node d = s->full ? i : touched[i], *nh;
+		unsigned int k;
+		cost c;
+
+		if (!rt_valid(g_rt, d) || d == me)
+			continue;
+		c = s->dist[d] < g_dv->inf ? s->dist[d] : INF_COST;
+		nh = s->hop + (size_t)d * s->paths;
+		k = s->nhop[d];
+		if (c == INF_COST || !k) {
+			nh = &g_rt->nh[d];
+			k = 1;
+		}
+		if (same_rte_paths(d, c, nh, k))
+			continue;
+		if (g_dv->verbose)
+			printf("[lsr]\t node(%u) cost(%d) via(%u) -> cost(%d) via(%u)%s\n",
+				d, g_rt->c[d], g_rt->nh[d], c, nh[0], k > 1 ? " and others" : "");
+		update_rte_paths(d, c, nh, k);
+		dv_route_changed(d, now);
+	}
+	s->full = false;
+}
+
+/*
+ * -------------------------------------
+ * Flooding
+ * -------------------------------------
+ */
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v) {
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static uint8_t *get_varint(uint8_t *p, uint8_t *end, uint32_t *v) {
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*v |= (uint32_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return 0x0;
+}
+
+static void put_hdr(uint8_t *p) {
+	p[0] = LSR_TYPE;
+	p[1] = LSR_VERSION;
+	p[2] = p[3] = 0;
+}
+
+/* append u's LSA to what is being built for l */
+static void lsr_put(struct lsr *s, struct link *l, node u) {
+	struct lsa *a = &s->db[u];
+	uint8_t *p;
+	size_t start, k;
+	node prev = NO_NODE;
+
+	tx = (uint8_t *) grow (tx, &tx_cap, tx_len + LSR_HDR + 15 + 10 * (size_t)a->n,
+		sizeof(uint8_t));
+	if (!ndgram) {
+		dgram = (size_t *) grow (dgram, &dgram_cap, 1, sizeof(size_t));
+		dgram[ndgram++] = tx_len;
+		put_hdr(tx + tx_len);
+		tx_len += LSR_HDR;
+	}
+	start = tx_len;
+	p = put_varint(tx + start, u);
+	p = put_varint(p, a->seq);
+	p = put_varint(p, a->n);
+	for (k = 0; k < a->n; k++) {
+		node v = s->to[a->off + k];
+
+		p = put_varint(p, v - prev - 1);
+		p = put_varint(p, s->c[a->off + k]);
+		prev = v;
+	}
+	tx_len = p - tx;
+
+	// over the MTU, so it starts a datagram of its own
+	if (tx_len - dgram[ndgram - 1] > l->mtu && start > dgram[ndgram - 1] + LSR_HDR) {
+		memmove(tx + start + LSR_HDR, tx + start, tx_len - start);
+		put_hdr(tx + start);
+		tx_len += LSR_HDR;
+		dgram = (size_t *) grow (dgram, &dgram_cap, ndgram + 1, sizeof(size_t));
+		dgram[ndgram++] = start;
+	}
+	if (tx_len - dgram[ndgram - 1] > DV_MAXDGRAM) {
+		fprintf(stderr, "[lsr] LSA of node(%u) does not fit a datagram\n", u);
+		tx_len = dgram[--ndgram];
+	}
+}
+
+static void lsr_send(struct link *l) {
+	size_t i;
+
+	if (!ndgram)
+		return;
+	iov = (struct iovec *) grow (iov, &iov_cap, ndgram, sizeof(struct iovec));
+	for (i = 0; i < ndgram; i++) {
+		iov[i].iov_base = tx + dgram[i];
+		iov[i].iov_len = (i + 1 < ndgram ? dgram[i + 1] : tx_len) - dgram[i];
+	}
+	dv_transmit(l, iov, ndgram);
+	if (g_dv->verbose)
+		printf("[lsr]\t sent %zu datagrams on %s\n", ndgram, l->name);
+	tx_len = ndgram = 0;
+}
+
+/* one LSA off the wire, seq is whatever the origin numbered it */
+static void lsr_receive(struct lsr *s, struct link *l, node u, uint32_t seq,
+	uint32_t n, node *to, cost *c) {
+	struct lsa *a = &s->db[u];
+
+	if (a->seq && (int32_t)(seq - a->seq) <= 0)
+		return;
+	if (u == g_dv->me) {
+		// from before I restarted, the next one must be newer still
+		lsr_originate_seq(seq, true);
+		return;
+	}
+	lsr_install(s, u, seq, n, to, c, l);
+}
+
+bool lsr_input(struct link *l, uint8_t *buf, size_t len) {
+	struct lsr *s = g_dv->lsr;
+	uint8_t *p = buf + LSR_HDR, *end = buf + len;
+
+	if (len < LSR_HDR || buf[0] != LSR_TYPE || buf[1] != LSR_VERSION)
+		return false;
+	while (p < end) {
+		uint32_t u, seq, n, i, k = 0, gap, c;
+		node v = NO_NODE;
+
+		if (!(p = get_varint(p, end, &u)) || !(p = get_varint(p, end, &seq)) ||
+		    !(p = get_varint(p, end, &n)) || n > (size_t)(end - p) / 2)
+			break;
+		rx_to = (node *) grow (rx_to, &rx_cap, n + 1, sizeof(node));
+		rx_c = (cost *) realloc (rx_c, rx_cap * sizeof(cost));
+		assert (rx_c);
+		for (i = 0; i < n; i++) {
+			if (!(p = get_varint(p, end, &gap)) || !(p = get_varint(p, end, &c)))
+				break;
+			v += gap + 1;
+			// ids past the routing table are as good as absent
+			if (v < s->cap) {
+				rx_to[k] = v;
+				rx_c[k++] = c;
+			}
+		}
+		if (i < n)
+			break;
+		if (u < s->cap && seq)
+			lsr_receive(s, l, u, seq, k, rx_to, rx_c);
+	}
+
+	// heard from again: bring it up to date
+	if (!l->synced) {
+		l->synced = true;
+		l->dump = true;
+		g_dv->dirty = true;
+	}
+	return true;
+}
+
+/* hellos go to neighbors only, they have nothing new to flood */
+void lsr_hello() {
+	struct lsr *s = g_dv->lsr;
+	struct link *l;
+
+	for (l = g_ls->next; l != g_ls; l = l->next) {
+		if (!l->adj)
+			continue;
+		lsr_put(s, l, g_dv->me);
+		lsr_send(l);
+	}
+}
+
+void lsr_flush(uint64_t now) {
+	struct lsr *s = g_dv->lsr;
+	struct link *l;
+	size_t i;
+	node u;
+
+	for (l = g_ls->next; l != g_ls; l = l->next) {
+		if (!l->adj)
+			continue;
+		if (l->dump) {
+			for (u = 0; u < s->cap; u++)
+				if (s->db[u].seq)
+					lsr_put(s, l, u);
+			l->dump = false;
+		} else {
+			for (i = 0; i < s->fq_len; i++)
+				if (s->fq_from[i] != l)
+					lsr_put(s, l, s->fq[i]);
+		}
+		lsr_send(l);
+	}
+	for (i = 0; i < s->fq_len; i++)
+		s->queued[s->fq[i] >> 6] &= ~(1ULL << (s->fq[i] & 63));
+	s->fq_len = 0;
+	if (s->spf)
+		lsr_spf(s, now);
+	g_dv->dirty = false;
+}
+
+#endif
@@ -5,6 +5,8 @@
 #ifndef _N2H_C_
 #define _N2H_C_
 
+#define _GNU_SOURCE // getaddrinfo_a
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -20,10 +22,25 @@
 #include "n2h.h"
 #include "queue.h"
 #include "rt.h"
+#include "uthash.h"
+#include "arena.h"
+#include "intern.h"
 
 #define logf (stdout)
 
+/* one lookup per distinct hostname, however many nodes share it */
+struct host {
+	char *name;
+	struct addrinfo hints;
+	struct gaicb cb;
+	UT_hash_handle hh;
+};
+
 static struct n2h *g_n2h;
+static struct arena n2h_arena; // entries are never deleted
+static struct n2h **g_n2h_by_id; // node id -> entry
+static node g_n2h_cap;
+static bool resolved = false;
 static int my_id;
 
 int create_n2h() {
@@ -49,40 +66,146 @@ int bind_port(int port) {
 	sockAddr.sin_port = htons(port);
 	if (bind(sd, (struct sockaddr *)&sockAddr, sizeof(sockAddr)) < 0) {
 		perror("bind(): failed");
+		close(sd);
 		return -1;
 	}
 	return sd;
 }
 
 /*
- * Check if <hostname> is a valid host
  * Add into node->hostname mapping
+ * <hostname> is checked later, when resolve_n2h looks up every host at once
  */
 int add_n2h(node nid, char *hostname) {
-	struct n2h* nl = (struct n2h *) getmem (sizeof (struct n2h));
+	struct n2h* nl;
+
+	// the same bound as rt.c's table, where cap would wrap doubling past it
+	if (nid >= RT_MAX_NODE) {
+		fprintf(stderr, "node id %u out of range, ids go up to %u\n", nid, RT_MAX_NODE - 1);
+		exit(1);
+	}
+	nl = (struct n2h *) arena_alloc (&n2h_arena, sizeof (struct n2h));
 	nl->nid = nid;
+	nl->local = false;
 
-	assert(gethostbyname(hostname));
-    
-	nl->hostname = (char *) malloc (strlen(hostname)+1);
-	strcpy (nl->hostname, hostname);
+	// thousands of nodes usually share a handful of hosts
+	nl->hostname = intern(hostname);
   
 	InsertDQ(g_n2h, nl);
+
+	if (nid >= g_n2h_cap) {
+		node cap = g_n2h_cap ? g_n2h_cap : 64;
+		while (cap <= nid)
+			cap *= 2;
+		g_n2h_by_id = (struct n2h **) realloc (g_n2h_by_id, cap * sizeof(struct n2h *));
+		assert (g_n2h_by_id);
+		memset(g_n2h_by_id + g_n2h_cap, 0, (cap - g_n2h_cap) * sizeof(struct n2h *));
+		g_n2h_cap = cap;
+	}
+	g_n2h_by_id[nid] = nl;
 	return (nl != 0x0);
 }
 
+static struct host *add_host(struct host **hosts, char *name) {
+	struct host *h;
+
+	HASH_FIND_STR(*hosts, name, h);
+	if (h)
+		return h;
+	h = (struct host *) getmem (sizeof (struct host));
+	memset(h, 0, sizeof(struct host));
+	h->name = name;
+	h->hints.ai_family = AF_INET;
+	h->hints.ai_socktype = SOCK_DGRAM;
+	h->cb.ar_name = name;
+	h->cb.ar_request = &h->hints;
+	HASH_ADD_KEYPTR(hh, *hosts, h->name, strlen(h->name), h);
+	return h;
+}
+
+static struct in_addr host_addr(struct host *h) {
+	int err = gai_error(&h->cb);
+
+	if (err) {
+		fprintf(stderr, "[n2h] cannot resolve %s: %s\n", h->name, gai_strerror(err));
+		exit(1);
+	}
+	return ((struct sockaddr_in *)h->cb.ar_result->ai_addr)->sin_addr;
+}
+
 /*
- * do "node_id->hostname mapping"
+ * Look up every hostname in the mapping, plus my own, in one parallel
+ * batch. Nothing after this touches the resolver.
  */
-char *gethostbynode(node nid) {
+void resolve_n2h() {
+	struct host *hosts = 0x0, *h, *tmp, *me;
+	struct gaicb **list;
 	struct n2h *i;
-    
-	for (i = g_n2h->next; i != g_n2h; i= i->next) {
-		assert(i);
-		if ( i->nid == nid )
-			return i->hostname;
+	struct in_addr my_addr;
+	char myhostname[256];
+	int n = 0, ret;
+
+	ret = gethostname(myhostname, 256);
+	assert (ret >= 0);
+	me = add_host(&hosts, myhostname);
+	for (i = g_n2h->next; i != g_n2h; i = i->next)
+		add_host(&hosts, i->hostname);
+
+	list = (struct gaicb **) getmem (HASH_COUNT(hosts) * sizeof(struct gaicb *));
+	HASH_ITER(hh, hosts, h, tmp)
+		list[n++] = &h->cb;
+	ret = getaddrinfo_a(GAI_WAIT, list, n, NULL);
+	if (ret && ret != EAI_ALLDONE && ret != EAI_SYSTEM) {
+		fprintf(stderr, "[n2h] getaddrinfo_a: %s\n", gai_strerror(ret));
+		exit(1);
+	}
+
+	my_addr = host_addr(me);
+	for (i = g_n2h->next; i != g_n2h; i = i->next) {
+		HASH_FIND_STR(hosts, i->hostname, h);
+		i->addr = host_addr(h);
+		i->local = i->addr.s_addr == my_addr.s_addr;
 	}
-	return 0x0;
+
+	HASH_ITER(hh, hosts, h, tmp) {
+		HASH_DEL(hosts, h);
+		freeaddrinfo(h->cb.ar_result);
+		free(h);
+	}
+	free(list);
+	resolved = true;
+}
+
+/*
+ * Drop the mapping, entries and index together
+ */
+void free_n2h() {
+	arena_free(&n2h_arena);
+	free(g_n2h_by_id);
+	free(g_n2h);
+	g_n2h_by_id = 0x0;
+	g_n2h_cap = 0;
+	g_n2h = 0x0;
+	resolved = false;
+}
+
+/*
+ * do "node_id->hostname mapping"
+ */
+char *gethostbynode(node nid) {
+	if (nid >= g_n2h_cap || !g_n2h_by_id[nid])
+		return 0x0;
+	return g_n2h_by_id[nid]->hostname;
+}
+
+/*
+ * address of node <nid>, as resolved at startup
+ */
+struct in_addr *getaddrbynode(node nid) {
+	assert (resolved);
+	if (nid >= g_n2h_cap || !g_n2h_by_id[nid])
+		return 0x0;
+	return &g_n2h_by_id[nid]->addr;
 }
 
 /*
@@ -130,31 +253,36 @@ node get_myid() {
 }
 
 /*
- * Is <nid> on my machine ?
+ * Iterate node ids in order:
+ *   for (id = next_n2h(NO_NODE); id != NO_NODE; id = next_n2h(id))
  */
-bool is_me(node nid) {
-	int ret;
-	int my_net_num;
-	int node_net_num;
-	char myhostname[256];
-	struct hostent *hp;
-
-	// get my net number
-	ret = gethostname(myhostname, 256);
-	assert (ret >= 0);
+node next_n2h(node prev) {
+	node id;
 
-	assert ((hp = gethostbyname(myhostname)));
-	memcpy (&my_net_num, hp->h_addr, 4);
+	for (id = prev + 1; id < g_n2h_cap; id++) // NO_NODE wraps around to 0
+		if (g_n2h_by_id[id])
+			return id;
+	return NO_NODE;
+}
 
-	// get nid's net number
-	assert ((hp = gethostbyname(gethostbynode(nid))));
-	memcpy(&node_net_num, hp->h_addr, 4);
+/*
+ * Exit unless the id given on the command line lives on this machine
+ */
+void check_myid() {
+	if (is_me(get_myid()) == false) {
+		printf("[ru] ==> given nodeid(%d)host(%s) is not localhost\n",
+		        get_myid(), gethostbynode(get_myid()));
+		exit(1);
+	}
+}
 
-	// it's me?
-	if (my_net_num == node_net_num)
-		return true;
-	else
-		return false;
+/*
+ * Is <nid> on my machine ?
+ */
+bool is_me(node nid) {
+	assert (resolved);
+	assert (nid < g_n2h_cap && g_n2h_by_id[nid]);
+	return g_n2h_by_id[nid]->local;
 }
 
 
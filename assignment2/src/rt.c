@@ -1,9 +1,13 @@
 /* $Id: rt.c,v 1.2 2000/02/23 00:51:25 bobby Exp bobby $
- * QD DQ implementation of RT
+ * Dense array implementation of RT
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "common.h"
 #include "rt.h"
@@ -11,70 +15,378 @@
 
 #define logf (stdout)
 
+struct rt *g_rt;
+unsigned int rt_max_paths = 1;
+
 int create_rt(){
-	InitDQ(g_rt, struct rte);
+	g_rt = (struct rt *) getmem (sizeof (struct rt));
 	assert (g_rt);
-	g_rt->d =  g_rt->c = g_rt ->nh = -1;
+	memset(g_rt, 0, sizeof(struct rt));
 	return (g_rt != 0x0);
 }
 
-int add_rte(node n, cost c, node nh){
-	struct rte* ne = (struct rte *) getmem (sizeof (struct rte));
-	ne->d = n;
-	ne->c = c;
-	ne->nh = nh;
-  
-	InsertDQ(g_rt, ne);
-	return (ne != 0x0);
+/* create_rt leaves the old table alone, the simulator keeps one per router */
+void free_rt(){
+	if (!g_rt)
+		return;
+	free(g_rt->c);
+	free(g_rt->nh);
+	free(g_rt->valid);
+	free(g_rt->paths);
+	free(g_rt->alt);
+	free(g_rt);
+	g_rt = 0x0;
 }
 
-struct rte *find_rte(node n){
-	struct rte *i;
-  
-	for (i = g_rt->next; i != g_rt; i = i->next){
-		if (i->d == n)
-			break;
+/* make room for destination n, new slots start out invalid */
+static void grow_rt(node n){
+	node cap = g_rt->cap ? g_rt->cap : 64;
+	size_t words, old_words = g_rt->cap / 64;
+
+	// past this cap would have to double beyond 2^32
+	if (n >= RT_MAX_NODE){
+		fprintf(stderr, "node id %u out of range, ids go up to %u\n", n, RT_MAX_NODE - 1);
+		exit(1);
 	}
-	if (i->d == n){
-		return i;
+	while (cap <= n)
+		cap *= 2;
+	words = cap / 64;
+	g_rt->c = (cost *) realloc (g_rt->c, cap * sizeof(cost));
+	g_rt->nh = (node *) realloc (g_rt->nh, cap * sizeof(node));
+	g_rt->valid = (uint64_t *) realloc (g_rt->valid, words * sizeof(uint64_t));
+	assert (g_rt->c && g_rt->nh && g_rt->valid);
+	memset(g_rt->valid + old_words, 0, (words - old_words) * sizeof(uint64_t));
+	if (rt_max_paths > 1){
+		g_rt->paths = (uint8_t *) realloc (g_rt->paths, cap);
+		g_rt->alt = (node *) realloc (g_rt->alt, (size_t)cap * (RT_ECMP - 1) * sizeof(node));
+		assert (g_rt->paths && g_rt->alt);
 	}
-	else{
-		return 0x0;
+	g_rt->cap = cap;
+}
+
+int add_rte(node n, cost c, node nh){
+	if (n == NO_NODE)
+		return 0;
+	if (n >= g_rt->cap)
+		grow_rt(n);
+	if (!rt_valid(g_rt, n)){
+		g_rt->valid[n >> 6] |= 1ULL << (n & 63);
+		g_rt->n++;
 	}
+	g_rt->c[n] = c;
+	g_rt->nh[n] = nh;
+	if (g_rt->paths)
+		g_rt->paths[n] = 1;
+	return 1;
+}
+
+/*
+ * The returned entry is a copy that is overwritten by the next call
+ */
+const struct rte *find_rte(node n){
+	static struct rte e;
+	unsigned int k;
+
+	if (!rt_valid(g_rt, n))
+		return 0x0;
+	e.d = n;
+	e.c = g_rt->c[n];
+	e.nh = g_rt->nh[n];
+	e.paths = rte_npaths(g_rt, n);
+	for (k = 1; k < e.paths; k++)
+		e.alt[k - 1] = rte_hop(g_rt, n, k);
+	return &e;
 }
 
 int update_rte(node n, cost c, node nh){
-	struct rte *i = find_rte(n);
+	if (!rt_valid(g_rt, n))
+		return -1;
+	g_rt->c[n] = c;
+	g_rt->nh[n] = nh;
+	if (g_rt->paths)
+		g_rt->paths[n] = 1;
+	return 0;
+}
+
+/* keeps the first rt_max_paths of nh */
+int update_rte_paths(node n, cost c, node *nh, unsigned int k){
+	unsigned int i;
 
-	if (i->d == n){
-		i->c = c;
-		i->nh = nh;
+	if (!rt_valid(g_rt, n))
+		return -1;
+	if (k > rt_max_paths)
+		k = rt_max_paths;
+	g_rt->c[n] = c;
+	g_rt->nh[n] = nh[0];
+	if (!g_rt->paths)
 		return 0;
-	}
-	else{
+	g_rt->paths[n] = k ? k : 1;
+	for (i = 1; i < k; i++)
+		g_rt->alt[(size_t)n * (RT_ECMP - 1) + i - 1] = nh[i];
+	return 0;
+}
+
+bool same_rte_paths(node n, cost c, node *nh, unsigned int k){
+	unsigned int i;
+
+	if (k > rt_max_paths)
+		k = rt_max_paths;
+	if (g_rt->c[n] != c || g_rt->nh[n] != nh[0] || rte_npaths(g_rt, n) != (k ? k : 1))
+		return false;
+	for (i = 1; i < k; i++)
+		if (rte_hop(g_rt, n, i) != nh[i])
+			return false;
+	return true;
+}
+
+/* another equally cheap next hop, if there is room for it */
+bool add_rte_hop(node n, node hop){
+	unsigned int k;
+
+	if (!rt_valid(g_rt, n) || !g_rt->paths || rte_via(n, hop))
+		return false;
+	k = g_rt->paths[n];
+	if (k >= rt_max_paths)
+		return false;
+	g_rt->alt[(size_t)n * (RT_ECMP - 1) + k - 1] = hop;
+	g_rt->paths[n] = k + 1;
+	return true;
+}
+
+bool rte_via(node n, node hop){
+	unsigned int k;
+
+	if (g_rt->nh[n] == hop)
+		return true;
+	for (k = 1; k < rte_npaths(g_rt, n); k++)
+		if (rte_hop(g_rt, n, k) == hop)
+			return true;
+	return false;
+}
+
+/* the same flow always takes the same path while the route stands */
+node pick_rte(node n, uint32_t flow){
+	unsigned int k;
+
+	if (!rt_valid(g_rt, n))
+		return NO_NODE;
+	k = rte_npaths(g_rt, n);
+	if (k == 1)
+		return g_rt->nh[n];
+	flow ^= flow >> 16;
+	flow *= 0x45d9f3b;
+	flow ^= flow >> 16;
+	return rte_hop(g_rt, n, flow % k);
+}
+
+int del_rte(node n){
+	if (!rt_valid(g_rt, n))
 		return -1;
+	g_rt->valid[n >> 6] &= ~(1ULL << (n & 63));
+	g_rt->n--;
+	return 0;
+}
+
+/*
+ * Iterate destinations in id order:
+ *   for (d = next_rte(NO_NODE); d != NO_NODE; d = next_rte(d))
+ */
+node next_rte(node prev){
+	node d = prev + 1; // NO_NODE wraps around to 0
+	size_t w = d >> 6, words = g_rt->cap / 64;
+	uint64_t bits;
+
+	if (w >= words)
+		return NO_NODE;
+	bits = g_rt->valid[w] & (~0ULL << (d & 63));
+	while (!bits){
+		if (++w >= words)
+			return NO_NODE;
+		bits = g_rt->valid[w];
 	}
+	return (node)(w * 64 + __builtin_ctzll(bits));
 }
 
-int del_rte(node n){
-	struct rte *i = find_rte(n);
-  
-	if (i->d == n){
-		DelDQ(i);
-		free(i);
-		return 0;
+/*
+ * -------------------------------------
+ * Min-plus relaxation
+ * -------------------------------------
+ *
+ * All kernels compute the same thing, lane by lane:
+ *
+ *   s = vec[d] + lc, unreachable if it wraps or reaches inf
+ *   if s < c[d] then c[d] = s, nh[d] = via and bit d of changed is set
+ *   if s == c[d] and nh[d] != via, bit d of ties is set
+ *
+ * The vector ones do 8 or 4 destinations per step and only store a
+ * step that moved something, so a vector that brings no news is a
+ * stream of loads.
+ */
+static size_t relax_scalar(cost *c, node *nh, const cost *vec, cost lc,
+	node via, cost inf, node lo, node hi, uint64_t *changed, uint64_t *ties){
+	size_t moved = 0;
+	node d;
+
+	for (d = lo; d < hi; d++){
+		cost s = vec[d] + lc;
+
+		if (s < vec[d] || s >= inf || s > c[d])
+			continue;
+		if (s == c[d]){
+			if (ties && nh[d] != via)
+				ties[d >> 6] |= 1ULL << (d & 63);
+			continue;
+		}
+		c[d] = s;
+		nh[d] = via;
+		changed[d >> 6] |= 1ULL << (d & 63);
+		moved++;
 	}
-	else{
-		return -1;
+	return moved;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t relax_avx2(cost *c, node *nh, const cost *vec, cost lc,
+	node via, cost inf, node lo, node hi, uint64_t *changed, uint64_t *ties){
+	__m256i vlc = _mm256_set1_epi32(lc), vvia = _mm256_set1_epi32(via);
+	__m256i vlast = _mm256_set1_epi32(inf - 1);
+	node head = (lo + 7) & ~7u, d;
+	size_t moved;
+
+	if (head > hi)
+		head = hi;
+	moved = relax_scalar(c, nh, vec, lc, via, inf, lo, head, changed, ties);
+	for (d = head; d + 8 <= hi; d += 8){
+		__m256i v = _mm256_loadu_si256((const __m256i *)(vec + d));
+		__m256i cur = _mm256_loadu_si256((const __m256i *)(c + d));
+		__m256i s = _mm256_add_epi32(v, vlc);
+		// s did not wrap and is below inf...
+		__m256i ok = _mm256_and_si256(
+			_mm256_cmpeq_epi32(_mm256_min_epu32(s, v), v),
+			_mm256_cmpeq_epi32(_mm256_min_epu32(s, vlast), s));
+		// ...and beats what we have
+		__m256i better = _mm256_andnot_si256(
+			_mm256_cmpeq_epi32(_mm256_min_epu32(cur, s), cur), ok);
+		unsigned int m = _mm256_movemask_ps(_mm256_castsi256_ps(better));
+		__m256i hop;
+
+		if (ties){
+			__m256i tie = _mm256_and_si256(_mm256_cmpeq_epi32(s, cur), ok);
+			unsigned int t = _mm256_movemask_ps(_mm256_castsi256_ps(tie));
+
+			if (t){
+				hop = _mm256_loadu_si256((const __m256i *)(nh + d));
+				t &= ~_mm256_movemask_ps(_mm256_castsi256_ps(
+					_mm256_cmpeq_epi32(hop, vvia)));
+				ties[d >> 6] |= (uint64_t)(t & 0xff) << (d & 63);
+			}
+		}
+		if (!m)
+			continue;
+		hop = _mm256_loadu_si256((const __m256i *)(nh + d));
+		_mm256_storeu_si256((__m256i *)(c + d), _mm256_blendv_epi8(cur, s, better));
+		_mm256_storeu_si256((__m256i *)(nh + d), _mm256_blendv_epi8(hop, vvia, better));
+		changed[d >> 6] |= (uint64_t)m << (d & 63);
+		moved += __builtin_popcount(m);
+	}
+	return moved + relax_scalar(c, nh, vec, lc, via, inf, d, hi, changed, ties);
+}
+
+__attribute__((target("sse4.1")))
+static size_t relax_sse41(cost *c, node *nh, const cost *vec, cost lc,
+	node via, cost inf, node lo, node hi, uint64_t *changed, uint64_t *ties){
+	__m128i vlc = _mm_set1_epi32(lc), vvia = _mm_set1_epi32(via);
+	__m128i vlast = _mm_set1_epi32(inf - 1);
+	node head = (lo + 3) & ~3u, d;
+	size_t moved;
+
+	if (head > hi)
+		head = hi;
+	moved = relax_scalar(c, nh, vec, lc, via, inf, lo, head, changed, ties);
+	for (d = head; d + 4 <= hi; d += 4){
+		__m128i v = _mm_loadu_si128((const __m128i *)(vec + d));
+		__m128i cur = _mm_loadu_si128((const __m128i *)(c + d));
+		__m128i s = _mm_add_epi32(v, vlc);
+		__m128i ok = _mm_and_si128(
+			_mm_cmpeq_epi32(_mm_min_epu32(s, v), v),
+			_mm_cmpeq_epi32(_mm_min_epu32(s, vlast), s));
+		__m128i better = _mm_andnot_si128(
+			_mm_cmpeq_epi32(_mm_min_epu32(cur, s), cur), ok);
+		unsigned int m = _mm_movemask_ps(_mm_castsi128_ps(better));
+		__m128i hop;
+
+		if (ties){
+			__m128i tie = _mm_and_si128(_mm_cmpeq_epi32(s, cur), ok);
+			unsigned int t = _mm_movemask_ps(_mm_castsi128_ps(tie));
+
+			if (t){
+				hop = _mm_loadu_si128((const __m128i *)(nh + d));
+				t &= ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hop, vvia)));
+				ties[d >> 6] |= (uint64_t)(t & 0xf) << (d & 63);
+			}
+		}
+		if (!m)
+			continue;
+		hop = _mm_loadu_si128((const __m128i *)(nh + d));
+		_mm_storeu_si128((__m128i *)(c + d), _mm_blendv_epi8(cur, s, better));
+		_mm_storeu_si128((__m128i *)(nh + d), _mm_blendv_epi8(hop, vvia, better));
+		changed[d >> 6] |= (uint64_t)m << (d & 63);
+		moved += __builtin_popcount(m);
 	}
+	return moved + relax_scalar(c, nh, vec, lc, via, inf, d, hi, changed, ties);
+}
+#endif
+
+struct rt_kernel rt_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", relax_avx2 },
+	{ "sse4.1", relax_sse41 },
+#endif
+	{ "scalar", relax_scalar },
+	{ 0x0, 0x0 }
+};
+
+/* the best kernel this CPU runs */
+static rt_relax_fn relax;
+
+bool rt_kernel_ok(struct rt_kernel *k){
+#if defined(__x86_64__) || defined(__i386__)
+	if (!strcmp(k->name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if (!strcmp(k->name, "sse4.1"))
+		return __builtin_cpu_supports("sse4.1");
+#endif
+	return true;
+}
+
+size_t rt_relax(const cost *vec, cost lc, node via, cost inf, node lo, node hi,
+	uint64_t *changed, uint64_t *ties){
+	if (!relax){
+		struct rt_kernel *k;
+
+		for (k = rt_kernels; !rt_kernel_ok(k); k++)
+			;
+		relax = k->fn;
+	}
+	if (hi > g_rt->cap)
+		hi = g_rt->cap;
+	if (lo >= hi)
+		return 0;
+	return relax(g_rt->c, g_rt->nh, vec, lc, via, inf, lo, hi, changed, ties);
 }
 
 /* print route */
-void print_rte(struct rte* i)
+void print_rte(const struct rte* i)
 {
+	unsigned int k;
+
 	assert (i);
-	fprintf (logf, "[rt]\tNode %d  Cost %d NextHop %d\n", 
+	fprintf (logf, "[rt]\tNode %d  Cost %d NextHop %d", 
 		i->d, i->c, i->nh);
+	for (k = 1; k < i->paths; k++)
+		fprintf (logf, ",%d", i->alt[k - 1]);
+	fprintf (logf, "\n");
 	return;
   
 }
@@ -82,13 +394,11 @@ void print_rte(struct rte* i)
 /* print routing table */
 void print_rt()
 {
-	struct rte *i;
+	node d;
 
 	fprintf (logf, "\n-- Routing table --\n");
 
-	for (i = g_rt->next; i != g_rt; i = i->next){
-		print_rte(i);
+	for (d = next_rte(NO_NODE); d != NO_NODE; d = next_rte(d)){
+		print_rte(find_rte(d));
 	}
 }
-
-
@@ -4,6 +4,9 @@
 #include <sys/types.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "es.h"
 #include "ls.h"
 #include "n2h.h"
@@ -12,6 +15,7 @@ extern char *rutext;
 int rulex (void *x);
 int ruerror(char *s);
 int ru_line_num = 1;
+void ru_scan_string (char *sc);
 %}
 
 %pure-parser
@@ -43,27 +47,39 @@ int ru_line_num = 1;
 
 %%
 
+/*
+ * Lists are left recursive so the parser stack stays flat no matter how
+ * many nodes, event sets or events a scenario has.
+ */
+config:
+ru
+{
+    // the simulator plays every node and never touches the network
+    if (get_myid() == NO_NODE)
+	YYACCEPT;
+
+    // look up every host once, up front
+    resolve_n2h();
+
+    // identify myself
+    check_myid();
+}
+;
+
 ru: 
 {
 }
 |
-node_line ru
+ru node_line
 {
-    // identify myself
-    if (is_me(get_myid()) == false) {
-	printf("[ru] ==> given nodeid(%d)host(%s) is not localhost\n",
-	        get_myid(), gethostbynode(get_myid()));
-        exit(1);
-    }
-
 }
 |
-open_paren_n event_set close_paren nl ru
+ru open_paren_n event_set close_paren nl
 {
     //printf ("[ru]\tparsed an event set\n");
 }
 |
-open_paren_n nl event_set close_paren nl ru
+ru open_paren_n nl event_set close_paren nl
 {
     //printf ("[ru]\tparsed an event set\n");
 }
@@ -100,15 +116,15 @@ token_node number name_t nl
 
 event_set: 
 |
-es_link event_set 
+event_set es_link
 {
 }
 |
-td_link event_set 
+event_set td_link
 {
 }
 |
-ud_link event_set
+event_set ud_link
 {
 }
 ;
@@ -153,3 +169,41 @@ int ruerror(char *s) {
     return 0;
 }
 
+/*
+ * Shared by every driver: load <sc_file> and point the parser at it
+ */
+long alloc_read(char **s, char *fname) {
+	int fd = -1;
+	struct stat sbuf;
+	char *fin;
+  
+	fd = open(fname, O_RDONLY);
+	if (fd < 0){
+		fprintf(stderr, "alloc-read: open failure\n");
+		exit(1);
+	}
+	fstat (fd, &sbuf);
+  
+	fin = (char *) malloc (sbuf.st_size+1);
+	if (!fin) {
+		fprintf(stderr, "alloc-read: malloc failure\n");
+		exit(1);
+	}
+	if (fd) {
+		read (fd, fin, sbuf.st_size);
+		close (fd);
+	}
+	fin[sbuf.st_size]=0x0;
+	*s = fin;
+	return sbuf.st_size;
+}
+ 
+void parser_init(char *sc_file) {
+	char *sc;
+
+	alloc_read(&sc, sc_file);
+	// puts contents of sc_file in string sc
+	ru_scan_string(sc);
+	//yy_scan_string (sc);
+	// parser is set to parse from sc
+}
@@ -0,0 +1,202 @@
+/* $Id$
+ * Compiled scenario image
+ */
+#ifndef _SC_C_
+#define _SC_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "queue.h"
+#include "uthash.h"
+#include "es.h"
+#include "n2h.h"
+#include "sc.h"
+
+struct sc_hdr *g_sc;
+
+/* string table under construction, offsets in insertion order */
+struct str {
+	char *s;
+	uint32_t off;
+	UT_hash_handle hh;
+};
+
+static struct str *strs;
+static uint64_t strs_len;
+
+static uint32_t str_off(char *s) {
+	struct str *i;
+
+	HASH_FIND_STR(strs, s, i);
+	if (i)
+		return i->off;
+	i = (struct str *) getmem (sizeof(struct str));
+	assert (i);
+	i->s = s;
+	i->off = strs_len;
+	strs_len += strlen(s) + 1;
+	HASH_ADD_KEYPTR(hh, strs, i->s, strlen(i->s), i);
+	return i->off;
+}
+
+static void sc_write(FILE *f, void *p, size_t len) {
+	if (len && fwrite(p, len, 1, f) != 1) {
+		perror("sc_compile: write failed");
+		exit(1);
+	}
+}
+
+bool sc_is_image(char *fname) {
+	char magic[8];
+	int fd = open(fname, O_RDONLY);
+	bool is = false;
+
+	if (fd < 0)
+		return false;
+	if (read(fd, magic, sizeof(magic)) == sizeof(magic))
+		is = !memcmp(magic, SC_MAGIC, sizeof(magic));
+	close(fd);
+	return is;
+}
+
+/*
+ * Two passes over what the parser built: count everything and lay out
+ * the string table, then stream the sections out in file order
+ */
+void sc_compile(char *fname) {
+	struct sc_hdr h;
+	size_t nel, i, j;
+	struct el *el = get_el(&nel);
+	struct es *es;
+	struct str *s, *tmp;
+	FILE *f;
+	node id;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SC_MAGIC, sizeof(h.magic));
+	h.version = SC_VERSION;
+	h.cost_bound = get_cost_bound();
+	for (id = next_n2h(NO_NODE); id != NO_NODE; id = next_n2h(id)) {
+		str_off(gethostbynode(id));
+		h.nnodes++;
+	}
+	h.nsets = nel;
+	for (i = 0; i < nel; i++) {
+		es = get_es(&el[i]);
+		for (j = 0; j < el[i].count; j++)
+			str_off(es[j].name);
+		h.nevents += el[i].count;
+	}
+	h.nodes_off = sizeof(h);
+	h.sets_off = h.nodes_off + (uint64_t)h.nnodes * sizeof(struct sc_node);
+	h.events_off = h.sets_off + (uint64_t)h.nsets * sizeof(struct sc_set);
+	h.strings_off = h.events_off + (uint64_t)h.nevents * sizeof(struct sc_event);
+	h.strings_len = strs_len;
+
+	f = fopen(fname, "w");
+	if (!f) {
+		perror("sc_compile: open failed");
+		exit(1);
+	}
+	setvbuf(f, 0x0, _IOFBF, 1 << 20);
+	sc_write(f, &h, sizeof(h));
+	for (id = next_n2h(NO_NODE); id != NO_NODE; id = next_n2h(id)) {
+		struct sc_node n = { id, str_off(gethostbynode(id)) };
+
+		sc_write(f, &n, sizeof(n));
+	}
+	for (i = 0; i < nel; i++) {
+		struct sc_set set = { el[i].first, el[i].count };
+
+		sc_write(f, &set, sizeof(set));
+	}
+	for (i = 0; i < nel; i++) {
+		es = get_es(&el[i]);
+		for (j = 0; j < el[i].count; j++) {
+			struct sc_event e;
+
+			memset(&e, 0, sizeof(e));
+			e.ev = es[j].ev;
+			e.peer0 = es[j].peer0;
+			e.port0 = es[j].port0;
+			e.peer1 = es[j].peer1;
+			e.port1 = es[j].port1;
+			e.cost = es[j].cost;
+			e.name = str_off(es[j].name);
+			sc_write(f, &e, sizeof(e));
+		}
+	}
+	HASH_ITER(hh, strs, s, tmp)
+		sc_write(f, s->s, strlen(s->s) + 1);
+	if (fclose(f)) {
+		perror("sc_compile: close failed");
+		exit(1);
+	}
+	printf("[sc] compiled %u nodes, %u event sets, %u events into %s\n",
+		h.nnodes, h.nsets, h.nevents, fname);
+}
+
+static void sc_bad(char *fname, char *why) {
+	fprintf(stderr, "[sc] %s: %s\n", fname, why);
+	exit(1);
+}
+
+/*
+ * Map the image and check that every section and set lies inside it.
+ * Events are checked as they are dispatched, so pages of event sets
+ * that are never reached are never read.
+ */
+void sc_load(char *fname) {
+	struct stat sbuf;
+	struct sc_hdr *h;
+	struct sc_node *n;
+	uint32_t i;
+	int fd = open(fname, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &sbuf) < 0)
+		sc_bad(fname, "cannot open");
+	if ((size_t)sbuf.st_size < sizeof(struct sc_hdr))
+		sc_bad(fname, "truncated");
+	h = (struct sc_hdr *) mmap(0x0, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (h == MAP_FAILED)
+		sc_bad(fname, "mmap failed");
+	close(fd);
+
+	if (memcmp(h->magic, SC_MAGIC, sizeof(h->magic)) || h->version != SC_VERSION)
+		sc_bad(fname, "not a scenario image of this version");
+	if (h->nodes_off + (uint64_t)h->nnodes * sizeof(struct sc_node) > h->sets_off ||
+	    h->sets_off + (uint64_t)h->nsets * sizeof(struct sc_set) > h->events_off ||
+	    h->events_off + (uint64_t)h->nevents * sizeof(struct sc_event) > h->strings_off ||
+	    h->strings_off + h->strings_len != (uint64_t)sbuf.st_size ||
+	    !h->strings_len || sc_str(h, h->strings_len - 1)[0])
+		sc_bad(fname, "corrupt layout");
+	for (i = 0; i < h->nsets; i++)
+		if ((uint64_t)sc_sets(h)[i].first + sc_sets(h)[i].count > h->nevents)
+			sc_bad(fname, "corrupt event set");
+
+	create_n2h();
+	n = (struct sc_node *)((char *)h + h->nodes_off);
+	for (i = 0; i < h->nnodes; i++) {
+		if (n[i].host >= h->strings_len)
+			sc_bad(fname, "corrupt node");
+		add_n2h(n[i].id, sc_str(h, n[i].host));
+	}
+	set_cost_bound(h->cost_bound);
+	madvise(h, sbuf.st_size, MADV_SEQUENTIAL);
+	g_sc = h;
+
+	if (get_myid() != NO_NODE) {
+		resolve_n2h();
+		check_myid();
+	}
+}
+
+#endif
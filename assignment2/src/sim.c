@@ -0,0 +1,540 @@
+/*
+ * Discrete-event simulator: every node of a scenario as a router in one
+ * process, joined by in-memory links with a fixed latency and driven by
+ * virtual time.
+ *
+ *   sim -f <config> [-l latency_ms] [-u update_time] [-t time_between_sets]
+ *       [-H holddown_ms] [-c routers_to_check] [-v]
+ *
+ * The routers run the same ls/rt/dv code as dr. Each one owns a link set,
+ * routing table and dv state, and the simulator points g_ls, g_rt, g_dv
+ * and my id at the router it is running. After every event set it runs
+ * until nothing is in flight, then prints one line with the convergence
+ * time, the updates that were sent and how many checked routes match a
+ * shortest path computed from the whole topology.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "queue.h"
+#include "uthash.h"
+#include "es.h"
+#include "ls.h"
+#include "rt.h"
+#include "n2h.h"
+#include "dv.h"
+#include "intern.h"
+
+void parser_init(char *sc_file);
+extern int ruparse();
+
+struct router {
+	node id;
+	struct link *ls;
+	struct rt *rt;
+	struct dv *dv;
+	uint64_t wake;    // its pending timer event, UINT64_MAX if none
+	bool touched;     // links changed in the current event set
+};
+
+/* both routers' copies of one link, by interned name */
+struct simlink {
+	char *name;
+	node peer[2];
+	struct link *end[2];  // 0x0 once torn down
+	UT_hash_handle hh;
+};
+
+/* a datagram arriving on end k of sl, or a timer if sl is 0x0 */
+struct sev {
+	uint64_t t;
+	uint64_t seq;
+	struct router *r;
+	struct simlink *sl;
+	int k;
+	size_t len;
+	uint8_t *buf;
+};
+
+static struct router *routers;
+static node nrouters, cap;
+static struct simlink *simlinks;
+static struct router *cur;
+
+static struct sev *heap;
+static size_t heap_len, heap_cap;
+static uint64_t seq, now, latency = 1;
+static size_t inflight;
+static unsigned long msgs, bytes;
+
+static char *sc_file = DefaultConfigFile;
+static unsigned int update_time = 3, time_between_sets = 30, holddown = 500;
+static unsigned int checked = 1000;
+static int verbose;
+
+static bool sev_before(struct sev *a, struct sev *b) {
+	if (a->t != b->t)
+		return a->t < b->t;
+	// datagrams first, so a timer at the same time sees all of them
+	if (!a->sl != !b->sl)
+		return a->sl != 0x0;
+	return a->seq < b->seq;
+}
+
+static void heap_push(struct sev *e) {
+	size_t i;
+
+	if (heap_len == heap_cap) {
+		heap_cap = heap_cap ? heap_cap * 2 : 1024;
+		heap = (struct sev *) realloc (heap, heap_cap * sizeof(struct sev));
+		assert (heap);
+	}
+	e->seq = seq++;
+	for (i = heap_len++; i > 0 && sev_before(e, &heap[(i - 1) / 2]); i = (i - 1) / 2)
+		heap[i] = heap[(i - 1) / 2];
+	heap[i] = *e;
+}
+
+static struct sev heap_pop() {
+	struct sev top = heap[0], last = heap[--heap_len];
+	size_t i = 0, c;
+
+	while ((c = 2 * i + 1) < heap_len) {
+		if (c + 1 < heap_len && sev_before(&heap[c + 1], &heap[c]))
+			c++;
+		if (!sev_before(&heap[c], &last))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+	return top;
+}
+
+static void use(struct router *r) {
+	cur = r;
+	g_ls = r->ls;
+	g_rt = r->rt;
+	g_dv = r->dv;
+	set_myid(r->id);
+}
+
+/* make sure r runs its timers by <t> */
+static void arm(struct router *r, uint64_t t) {
+	struct sev e = { .t = t, .r = r };
+
+	if (t >= r->wake)
+		return;
+	r->wake = t;
+	heap_push(&e);
+}
+
+/* after r handled something: flush right away if it has news */
+static void rearm(struct router *r) {
+	arm(r, r->dv->dirty ? now : tw_next(&r->dv->tw));
+}
+
+static void sim_output(struct link *l, struct iovec *iov, size_t n) {
+	struct simlink *sl;
+	struct sev e;
+	size_t i;
+	int k;
+
+	HASH_FIND_PTR(simlinks, &l->name, sl);
+	assert (sl);
+	k = sl->end[0] == l ? 1 : 0;
+	if (!sl->end[k])
+		return;
+	for (i = 0; i < n; i++) {
+		e.t = now + latency;
+		e.r = &routers[sl->peer[k]];
+		e.sl = sl;
+		e.k = k;
+		e.len = iov[i].iov_len;
+		e.buf = (uint8_t *) malloc (e.len);
+		assert (e.buf);
+		memcpy(e.buf, iov[i].iov_base, e.len);
+		heap_push(&e);
+		inflight++;
+		msgs++;
+		bytes += e.len;
+	}
+}
+
+static void dispatch_set(struct el *el) {
+	struct es *es = get_es(el), *end = es + el->count;
+	struct simlink *sl;
+	node i;
+	int k;
+
+	for (; es != end; es++) {
+		HASH_FIND_PTR(simlinks, &es->name, sl);
+		if (es->ev == _es_link) {
+			if (!sl) {
+				sl = (struct simlink *) getmem (sizeof(struct simlink));
+				memset(sl, 0, sizeof(struct simlink));
+				sl->name = es->name;
+				HASH_ADD_PTR(simlinks, name, sl);
+			}
+			sl->peer[0] = es->peer0;
+			sl->peer[1] = es->peer1;
+		} else if (!sl || !sl->end[0]) {
+			printf("[sim]\t no link %s, skip\n", es->name);
+			continue;
+		}
+		for (k = 0; k < 2; k++) {
+			if (k == 1 && sl->peer[1] == sl->peer[0])
+				break;
+			if (sl->peer[k] >= cap || !routers[sl->peer[k]].rt) {
+				printf("[sim]\t no node %u, skip\n", sl->peer[k]);
+				continue;
+			}
+			use(&routers[sl->peer[k]]);
+			if (es->ev != _es_link)
+				find_iname(es->name)->link = sl->end[k];
+			dispatch_event(es);
+			sl->end[k] = es->ev == _td_link ? 0x0 : find_link(es->name);
+			cur->touched = true;
+		}
+	}
+
+	for (i = 0; i < cap; i++) {
+		if (!routers[i].touched)
+			continue;
+		routers[i].touched = false;
+		use(&routers[i]);
+		dv_sync_links(now);
+		rearm(cur);
+	}
+}
+
+/* nothing in flight and no router waiting on anything but a periodic */
+static bool quiet() {
+	node i;
+
+	if (inflight)
+		return false;
+	for (i = 0; i < cap; i++)
+		if (routers[i].dv && (routers[i].dv->dirty || routers[i].dv->hd_len ||
+		    routers[i].dv->damped || routers[i].dv->deferred || routers[i].dv->coming_up))
+			return false;
+	return true;
+}
+
+/* run until the set has settled or <until>, returns when the last route changed */
+static uint64_t run(uint64_t until) {
+	uint64_t last = now;
+
+	while (heap_len && heap[0].t < until) {
+		struct sev e = heap_pop();
+		unsigned long changes;
+
+		if (!e.sl && e.t != e.r->wake)
+			continue; // superseded by an earlier timer
+		now = e.t;
+		use(e.r);
+		changes = g_dv->changes;
+		if (e.sl) {
+			// the link may have been torn down while this was in flight
+			inflight--;
+			if (e.sl->end[e.k])
+				dv_input(e.sl->end[e.k], e.buf, e.len, now);
+			free(e.buf);
+		} else {
+			e.r->wake = UINT64_MAX;
+			dv_timers(now);
+		}
+		rearm(e.r);
+		if (g_dv->changes != changes)
+			last = now;
+		if (!inflight && (!heap_len || heap[0].t > now) && quiet())
+			break;
+	}
+	return last;
+}
+
+/*
+ * Periodic updates while everything is quiet cannot change a thing, so
+ * skip to <t> with every router's periodic clock kept in phase
+ */
+static void fast_forward(uint64_t t) {
+	node i;
+
+	heap_len = 0;
+	for (i = 0; i < cap; i++) {
+		if (!routers[i].dv)
+			continue;
+		use(&routers[i]);
+		dv_skip(t);
+		routers[i].wake = UINT64_MAX;
+		rearm(cur);
+	}
+	now = t;
+}
+
+/* every router's window of the set, summed into one [stats] line */
+static void report(int set, uint64_t start) {
+	struct dv_stats sum;
+	node i;
+
+	memset(&sum, 0, sizeof(sum));
+	sum.since = start;
+	for (i = 0; i < cap; i++) {
+		struct dv_stats *st;
+
+		if (!routers[i].dv)
+			continue;
+		st = &routers[i].dv->stats;
+		if (st->last_change > sum.last_change)
+			sum.last_change = st->last_change;
+		sum.changes += st->changes;
+		sum.flaps += st->flaps;
+		sum.tx_msgs += st->tx_msgs;
+		sum.tx_bytes += st->tx_bytes;
+		sum.rx_msgs += st->rx_msgs;
+		sum.rx_bytes += st->rx_bytes;
+		sum.switched += st->switched;
+		sum.damped += st->damped;
+		sum.hello_tx += st->hello_tx;
+		sum.hello_rx += st->hello_rx;
+	}
+	dv_stats_print(&sum, set, NO_NODE);
+}
+
+/* shortest paths over the current topology */
+static node *adj_off, *adj_to;
+static cost *adj_c;
+
+static void build_adj() {
+	struct simlink *sl, *tmp;
+	node *deg = (node *) calloc (cap + 1, sizeof(node));
+	size_t e = 0, i;
+
+	assert (deg);
+	HASH_ITER(hh, simlinks, sl, tmp)
+		if (sl->end[0] && sl->peer[0] != sl->peer[1]) {
+			deg[sl->peer[0]]++;
+			deg[sl->peer[1]]++;
+			e += 2;
+		}
+	free(adj_off);
+	free(adj_to);
+	free(adj_c);
+	adj_off = (node *) calloc (cap + 1, sizeof(node));
+	adj_to = (node *) malloc ((e + 1) * sizeof(node));
+	adj_c = (cost *) malloc ((e + 1) * sizeof(cost));
+	assert (adj_off && adj_to && adj_c);
+	for (i = 0; i < cap; i++)
+		adj_off[i + 1] = adj_off[i] + deg[i];
+	memset(deg, 0, cap * sizeof(node));
+	HASH_ITER(hh, simlinks, sl, tmp)
+		if (sl->end[0] && sl->peer[0] != sl->peer[1]) {
+			node a = sl->peer[0], b = sl->peer[1];
+
+			adj_to[adj_off[a] + deg[a]] = b;
+			adj_c[adj_off[a] + deg[a]++] = sl->end[0]->c;
+			adj_to[adj_off[b] + deg[b]] = a;
+			adj_c[adj_off[b] + deg[b]++] = sl->end[0]->c;
+		}
+	free(deg);
+}
+
+static void dijkstra(node src, cost *dist, node *pq) {
+	size_t n = 0, i, c;
+	node u, v;
+
+	for (i = 0; i < cap; i++)
+		dist[i] = INF_COST;
+	dist[src] = 0;
+	pq[n++] = src;
+	while (n) {
+		// lazy binary heap keyed by dist, stale entries are skipped
+		u = pq[0];
+		pq[0] = pq[--n];
+		for (i = 0; (c = 2 * i + 1) < n; i = c) {
+			if (c + 1 < n && dist[pq[c + 1]] < dist[pq[c]])
+				c++;
+			if (dist[pq[c]] >= dist[pq[i]])
+				break;
+			v = pq[i]; pq[i] = pq[c]; pq[c] = v;
+		}
+		for (i = adj_off[u]; i < adj_off[u + 1]; i++) {
+			v = adj_to[i];
+			if (dist[u] + adj_c[i] >= dist[v])
+				continue;
+			dist[v] = dist[u] + adj_c[i];
+			pq[n] = v;
+			for (c = n++; c > 0 && dist[pq[(c - 1) / 2]] > dist[pq[c]]; c = (c - 1) / 2) {
+				node t = pq[c]; pq[c] = pq[(c - 1) / 2]; pq[(c - 1) / 2] = t;
+			}
+		}
+	}
+}
+
+/*
+ * check a spread of routers against Dijkstra, counts routes that are
+ * right and how many of those have more than one next hop
+ */
+static void check(unsigned long *good, unsigned long *total, unsigned long *multi) {
+	cost *dist;
+	node *pq;
+	node step = checked && checked < nrouters ? nrouters / checked : 1;
+	node i, seen = 0, d;
+
+	build_adj();
+	dist = (cost *) malloc (cap * sizeof(cost));
+	pq = (node *) malloc ((adj_off[cap] + 1) * sizeof(node));
+	assert (dist && pq);
+	*good = *total = *multi = 0;
+	for (i = 0; i < cap; i++) {
+		if (!routers[i].rt || seen++ % step)
+			continue;
+		dijkstra(i, dist, pq);
+		use(&routers[i]);
+		for (d = next_rte(NO_NODE); d != NO_NODE; d = next_rte(d)) {
+			(*total)++;
+			if (g_rt->c[d] != dist[d])
+				continue;
+			(*good)++;
+			if (rte_npaths(g_rt, d) > 1)
+				(*multi)++;
+		}
+	}
+	free(dist);
+	free(pq);
+}
+
+static double wall() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [-f <config_file>] [-l latency_ms] [-u update_time] "
+		"[-t time_between_sets] [-H holddown_ms] [-c routers_to_check] [-m dv|ls] [-E paths]\n"
+		"       [-b hello_ms] [-d detect_mult] [-D damp_half_life_ms] [-T trigger_ms] [-v]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct el *el;
+	size_t nel;
+	struct rt *all;
+	node id;
+	int opt, set;
+	double t0 = wall();
+
+	while ((opt = getopt(argc, argv, "f:l:u:t:H:c:m:E:b:d:D:T:v")) != -1) {
+		switch (opt) {
+			case 'f': sc_file = optarg; break;
+			case 'l': latency = atoi(optarg); break;
+			case 'u': update_time = atoi(optarg); break;
+			case 't': time_between_sets = atoi(optarg); break;
+			case 'H': holddown = atoi(optarg); break;
+			case 'c': checked = atoi(optarg); break;
+			case 'm':
+				if (!strcmp(optarg, "ls"))
+					dv_link_state = true;
+				else if (strcmp(optarg, "dv"))
+					usage(argv[0]);
+				break;
+			case 'E':
+				rt_max_paths = atoi(optarg);
+				if (rt_max_paths < 1 || rt_max_paths > RT_ECMP)
+					usage(argv[0]);
+				break;
+			case 'b': bfd_interval = atoi(optarg); break;
+			case 'd':
+				bfd_mult = atoi(optarg);
+				if (bfd_mult < 1 || bfd_mult > 255)
+					usage(argv[0]);
+				break;
+			case 'D': dv_damp_half_ms = atoi(optarg); break;
+			case 'T': dv_trigger_ms = atoi(optarg); break;
+			case 'v': verbose = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || !update_time)
+		usage(argv[0]);
+
+	set_myid(NO_NODE);
+	parser_init(sc_file);
+	ruparse();
+
+	ls_bind_ports = false;
+	dv_output = sim_output;
+
+	// a table with a slot for everybody tells us who everybody is
+	create_rt();
+	init_rt_from_n2h();
+	all = g_rt;
+	cap = all->cap;
+	routers = (struct router *) calloc (cap, sizeof(struct router));
+	assert (routers);
+	for (id = next_rte(NO_NODE); id != NO_NODE; id = next_rte(id)) {
+		struct router *r = &routers[id];
+
+		r->id = id;
+		r->wake = UINT64_MAX;
+		set_myid(id);
+		create_ls();
+		create_rt();
+		init_rt_from_n2h();
+		dv_init(update_time, holddown, verbose, 0);
+		r->ls = g_ls;
+		r->rt = g_rt;
+		r->dv = g_dv;
+		nrouters++;
+	}
+	printf("[sim] %u routers, set up in %.3f s\n", nrouters, wall() - t0);
+
+	el = get_el(&nel);
+	for (set = 0; set < (int)nel; set++) {
+		uint64_t start = (uint64_t)set * time_between_sets * 1000, last;
+		unsigned long good, total, multi;
+		double t1 = wall();
+
+		run(start);
+		if (quiet())
+			fast_forward(start);
+		now = start;
+		msgs = bytes = 0;
+		for (id = 0; id < cap; id++)
+			if (routers[id].dv) {
+				use(&routers[id]);
+				dv_stats_reset(now);
+			}
+		dispatch_set(&el[set]);
+		last = run(start + (uint64_t)time_between_sets * 1000);
+		t1 = wall() - t1;
+		check(&good, &total, &multi);
+		printf("[sim] set %d: converged in %llu ms, %lu datagrams, %lu bytes, "
+			"%lu/%lu routes correct, %.3f s wall\n",
+			set, (unsigned long long)(last - start), msgs, bytes, good, total, t1);
+		if (rt_max_paths > 1)
+			printf("[sim] set %d: %lu routes with more than one next hop\n", set, multi);
+		report(set, start);
+	}
+
+	for (id = 0; id < cap; id++)
+		if (routers[id].dv) {
+			use(&routers[id]);
+			free_ls();
+			free_rt();
+		}
+	g_rt = all;
+	free_rt();
+	free_scenario();
+	free(routers);
+	return 0;
+}
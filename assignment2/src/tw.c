@@ -0,0 +1,152 @@
+/* $Id$
+ * Hierarchical timing wheel, after the one in assignment1
+ */
+#ifndef _TW_C_
+#define _TW_C_
+
+#include "tw.h"
+
+#define LEVEL_SHIFT(l) (TW_BITS * (l))
+
+static inline uint64_t rotr64(uint64_t x, unsigned n) {
+	n &= 63;
+	return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+static void link_timer(struct tw_timer *head, struct tw_timer *t) {
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/* put t in the slot that will be reached closest to, but not after, its deadline */
+static void place(struct timerwheel *tw, struct tw_timer *t) {
+	uint64_t expires = t->expires;
+	int level = TW_LEVELS - 1, l;
+	uint64_t last = ((tw->now >> LEVEL_SHIFT(level)) + TW_MASK) << LEVEL_SHIFT(level);
+
+	if (expires < tw->now)
+		expires = tw->now;
+	else if (expires > last)
+		expires = last; // placed again with its real deadline when it cascades
+	for (l = 0; l < TW_LEVELS; l++) {
+		if ((expires >> LEVEL_SHIFT(l)) - (tw->now >> LEVEL_SHIFT(l)) < TW_SIZE) {
+			level = l;
+			break;
+		}
+	}
+	t->level = level;
+	t->slot = (expires >> LEVEL_SHIFT(level)) & TW_MASK;
+	link_timer(&tw->slots[level][t->slot], t);
+	tw->occupied[level] |= 1ULL << t->slot;
+}
+
+void tw_init(struct timerwheel *tw, uint64_t now) {
+	int l, s;
+
+	tw->now = now;
+	tw->count = 0;
+	for (l = 0; l < TW_LEVELS; l++) {
+		tw->occupied[l] = 0;
+		for (s = 0; s < TW_SIZE; s++)
+			tw->slots[l][s].next = tw->slots[l][s].prev = &tw->slots[l][s];
+	}
+}
+
+void tw_add(struct timerwheel *tw, struct tw_timer *t, uint64_t expires) {
+	t->expires = expires > tw->now ? expires : tw->now + 1;
+	place(tw, t);
+	tw->count++;
+}
+
+void tw_del(struct timerwheel *tw, struct tw_timer *t) {
+	struct tw_timer *head;
+
+	if (!t->next)
+		return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = 0x0;
+	head = &tw->slots[t->level][t->slot];
+	if (head->next == head)
+		tw->occupied[t->level] &= ~(1ULL << t->slot);
+	tw->count--;
+}
+
+/* move a pending or idle timer to a new deadline */
+void tw_mod(struct timerwheel *tw, struct tw_timer *t, uint64_t expires) {
+	tw_del(tw, t);
+	tw_add(tw, t, expires);
+}
+
+/*
+ * For timers in higher levels this is the time they cascade, which is
+ * never later than their deadline
+ */
+uint64_t tw_next(struct timerwheel *tw) {
+	uint64_t next = TW_NEVER, block, cascade;
+	unsigned start;
+	int l;
+
+	if (tw->occupied[0]) {
+		start = (tw->now + 1) & TW_MASK;
+		next = tw->now + 1 + __builtin_ctzll(rotr64(tw->occupied[0], start));
+	}
+	for (l = 1; l < TW_LEVELS; l++) {
+		if (!tw->occupied[l])
+			continue;
+		block = tw->now >> LEVEL_SHIFT(l);
+		start = (block + 1) & TW_MASK;
+		cascade = (block + 1 + __builtin_ctzll(rotr64(tw->occupied[l], start))) << LEVEL_SHIFT(l);
+		if (cascade < next)
+			next = cascade;
+	}
+	return next;
+}
+
+/* move every timer in a higher level slot down to where it now belongs */
+static void cascade(struct timerwheel *tw, int level, unsigned slot) {
+	struct tw_timer *head = &tw->slots[level][slot];
+	struct tw_timer *t = head->next, *next;
+
+	head->next = head->prev = head;
+	tw->occupied[level] &= ~(1ULL << slot);
+	for (; t != head; t = next) {
+		next = t->next;
+		place(tw, t);
+	}
+}
+
+/*
+ * Run the clock forward to <now>. Timers are unlinked before they fire,
+ * so the callback may free or re-add them.
+ */
+size_t tw_advance(struct timerwheel *tw, uint64_t now) {
+	size_t fired = 0;
+	uint64_t tick;
+	struct tw_timer *head, *t;
+	int l;
+
+	while (tw->now < now) {
+		tick = tw_next(tw);
+		if (tick > now) {
+			tw->now = now;
+			break;
+		}
+		tw->now = tick;
+		for (l = TW_LEVELS - 1; l > 0; l--)
+			if (!(tick & ((1ULL << LEVEL_SHIFT(l)) - 1)))
+				cascade(tw, l, (tick >> LEVEL_SHIFT(l)) & TW_MASK);
+		head = &tw->slots[0][tick & TW_MASK];
+		while (head->next != head) {
+			t = head->next;
+			tw_del(tw, t);
+			t->fn(t, tick);
+			fired++;
+		}
+	}
+	return fired;
+}
+
+#endif
@@ -5,8 +5,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
 #include <sys/fcntl.h>
-#include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sysexits.h>
@@ -15,7 +17,7 @@
 
 #include "uthash.h"
 
-#define MAX_CLIENTS 20
+#define MAX_EVENTS 64 // Ready sockets handled per epoll_wait
 #define MAX_PAYLOAD_SIZE 256
 
 enum client_state {
@@ -47,7 +49,9 @@ struct client_frame {
 	size_t expected_recv;
 	size_t recv_len;
 	time_t ttl;
-	short *pollEvents;
+	size_t deadline; // Position in the deadline heap, 0 if not in it
+	int sock;
+	uint32_t events; // What epoll is watching for
 	UT_hash_handle hh;
 };
 
@@ -64,7 +68,7 @@ struct server_arguments {
 
 int room_sort(struct room *a, struct room *b) { return strcmp(a->name, b->name); }
 
-int handleIncomingClient(int servSock, struct client_frame *locals);
+int handleIncomingClient(int servSock);
 
 void handleIncomingMessage(int clientSock, struct client_frame *locals);
 
@@ -78,6 +82,14 @@ uint8_t *createServerResponse(int code, char *message);
 
 void queueMessage(struct client_frame *client, uint8_t *message);
 
+void setEvents(struct client_frame *client, uint32_t events);
+
+void setDeadline(struct client_frame *client, time_t ttl);
+
+int expireClients();
+
+void closeClient(struct client_frame *client);
+
 void destroyClient(struct client_frame *client);
 
 void handleLeave(struct room *room);
@@ -7,6 +7,13 @@
 
 struct client_frame *clients = NULL; // Tracks clients that have gotten past the handshake
 struct room *rooms = NULL;
+int servSock; // Socket descriptor for server
+int epollFd;
+int acceptPaused = 0; // Ran out of descriptors, the server socket isn't watched
+
+// Clients still in the handshake, a min-heap on ttl so only those due are looked at
+struct client_frame **deadlines = NULL;
+size_t deadlines_len = 0, deadlines_cap = 0;
 
 error_t server_parser(int key, char *arg, struct argp_state *state) {
 	struct server_arguments *args = state->input;
@@ -44,27 +51,25 @@ void server_parseopt(struct server_arguments *args, int argc, char *argv[]) {
 }
 
 int main(int argc, char *argv[]) {
-	struct pollfd ufds[1 + MAX_CLIENTS]; // Server + 15 concurrent clients
-	struct client_frame *clientsArr[MAX_CLIENTS];
+	struct epoll_event events[MAX_EVENTS];
     struct server_arguments args;
 
 	server_parseopt(&args, argc, argv);
 
+	// Every client holds a descriptor, so the only cap is the process's
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
 
  	// Create socket for incoming connections
-	int servSock; // Socket descriptor for server
 	if ((servSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
 		perror("socket() failed");
 		exit(1);
 	}
 	fcntl(servSock, F_SETFL, O_NONBLOCK);
 
-	ufds[0].fd = servSock;
-	ufds[0].events = POLLIN | POLLPRI;
-
-	// Initialize the rest of the ufds array
-	for (int i = 0; i < MAX_CLIENTS; i++) ufds[i+1].fd = -1;
-
 	// Construct local address structure
 	struct sockaddr_in servAddr; // Local address
 	memset(&servAddr, 0, sizeof(servAddr)); // Zero out structure
@@ -83,67 +88,85 @@ int main(int argc, char *argv[]) {
 		perror("listen() failed");
 		exit(1);
 	}
-	
-	int hasIncomingClient;
-	int timeout = -1;
-	for (;;) switch (poll(ufds, 1 + MAX_CLIENTS, timeout)) {
-	case -1:
-		perror("poll() failed");
+
+	// Clients carry their frame in the event data, the server socket has none
+	if ((epollFd = epoll_create1(0)) < 0) {
+		perror("epoll_create1() failed");
 		exit(1);
-	case 0:
-	default:
-		timeout = -1;
-		hasIncomingClient = ufds[0].revents & POLLIN;
-		for (int i = 0; i < MAX_CLIENTS; i++) {
-			if (ufds[i+1].fd < 0) {
-				if (hasIncomingClient) { // Server can handle incoming connection
-					clientsArr[i] = malloc(sizeof(struct client_frame));
-					ufds[i+1].fd = handleIncomingClient(servSock, clientsArr[i]);
-					ufds[i+1].events = POLLIN;
-					clientsArr[i]->pollEvents = &ufds[i+1].events;
-					hasIncomingClient = 0;
-				} else continue;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, servSock, &ev) < 0) {
+		perror("epoll_ctl() failed");
+		exit(1);
+	}
+
+	for (;;) {
+		int n = epoll_wait(epollFd, events, MAX_EVENTS, expireClients());
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait() failed");
+			exit(1);
+		}
+		// Only the sockets that are ready are looked at
+		for (int i = 0; i < n; i++) {
+			struct client_frame *client = events[i].data.ptr;
+			if (!client) { // Server can handle incoming connections
+				while (handleIncomingClient(servSock) >= 0);
+				continue;
 			}
-			if (ufds[i+1].revents & POLLIN) {
-				handleIncomingMessage(ufds[i+1].fd, clientsArr[i]);
+			if (events[i].events & EPOLLIN) {
+				handleIncomingMessage(client->sock, client);
 			}
-			if (ufds[i+1].revents & POLLOUT) {
-				flushOutgoingMessages(ufds[i+1].fd, clientsArr[i]);
+			if (events[i].events & EPOLLOUT && client->state != CLIENT_CLOSED) {
+				flushOutgoingMessages(client->sock, client);
 			}
-			if (clientsArr[i]->ttl) {
-				if (clientsArr[i]->ttl <= time(NULL)) {
-					clientsArr[i]->state = CLIENT_CLOSED;
-				} else if (timeout < 0 || timeout < 1000 * (clientsArr[i]->ttl - time(NULL))) {
-					timeout = 1000 * (clientsArr[i]->ttl - time(NULL));
-				}
+			// Reported even when nothing is watched, so an invalid client that hangs up goes too
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				client->state = CLIENT_CLOSED;
 			}
-			if (clientsArr[i]->state == CLIENT_CLOSED) {
-				close(ufds[i+1].fd);
-				ufds[i+1].fd = -1;
-				destroyClient(clientsArr[i]);
+			if (client->state == CLIENT_CLOSED) {
+				closeClient(client);
 			}
 		}
-		break;
 	}
 }
 
-int handleIncomingClient(int servSock, struct client_frame *locals) {
+int handleIncomingClient(int servSock) {
 	struct sockaddr_in clientAddr; // Client address
 	// Set length of client address structure (in-out parameter)
 	socklen_t clientAddrLen = sizeof(clientAddr);
 
-	// Wait for a client to connect
+	// Take the next waiting client, if there is one
 	int clientSock = accept(servSock, (struct sockaddr *)&clientAddr, &clientAddrLen);
 	if (clientSock < 0) {
-		perror("accept() failed");
-		exit(1);
+		if (errno == EMFILE || errno == ENFILE) {
+			// Out of descriptors, stop listening until a client closes
+			perror("accept() failed");
+			struct epoll_event ev = { .events = 0, .data.ptr = NULL };
+			epoll_ctl(epollFd, EPOLL_CTL_MOD, servSock, &ev);
+			acceptPaused = 1;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+			perror("accept() failed");
+			exit(1);
+		}
+		return -1;
 	}
 	fcntl(clientSock, F_SETFL, O_NONBLOCK);
 
+	struct client_frame *locals = malloc(sizeof(struct client_frame));
 	memset(locals, 0, sizeof(*locals));
 	locals->state = CLIENT_INIT;
 	locals->recvBuf = malloc(7 + MAX_PAYLOAD_SIZE);
-	locals->ttl = time(NULL) + 30;
+	locals->sock = clientSock;
+	locals->events = EPOLLIN;
+	setDeadline(locals, time(NULL) + 30);
+
+	struct epoll_event ev = { .events = locals->events, .data.ptr = locals };
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSock, &ev) < 0) {
+		perror("epoll_ctl() failed");
+		closeClient(locals);
+		return clientSock;
+	}
 
 	// char clientName[INET_ADDRSTRLEN]; // String to contain client address
 	// if (inet_ntop(AF_INET, &clientAddr.sin_addr.s_addr, clientName, sizeof(clientName)) != NULL) {
@@ -162,7 +185,7 @@ void handleIncomingMessage(int clientSock, struct client_frame *locals) {
 	}
 	if (locals->state == CLIENT_INIT) {
 		locals->state = CLIENT_HANDSHAKE;
-		locals->ttl += 30;
+		setDeadline(locals, locals->ttl + 30);
 	}
 	numBytesRcvd = recv(clientSock, recvBuf + locals->recv_len, locals->expected_recv, 0);
 	if (numBytesRcvd < 0) {
@@ -195,7 +218,7 @@ void handleIncomingMessage(int clientSock, struct client_frame *locals) {
 				} else if (!payload_len) {
 					locals->state = CLIENT_INVALID; // 0-length Hello packet puts client into invalid state
 				} else {
-					locals->ttl = 0;
+					setDeadline(locals, 0);
 					char *hello = "Hello";
 					if (strncmp(hello, (char *)payload, payload_len) != 0) {
 						queueMessage(locals, createServerResponse(1, "I don't actually have time for this nonsense."));
@@ -224,9 +247,9 @@ void handleIncomingMessage(int clientSock, struct client_frame *locals) {
 	}
 	if (locals->state == CLIENT_CLOSING) {
 		// Closing, stop accepting messages
-		*locals->pollEvents &= ~POLLIN;
+		setEvents(locals, locals->events & ~EPOLLIN);
 	} else if (locals->state == CLIENT_INVALID) {
-		*locals->pollEvents = 0;
+		setEvents(locals, 0);
 	}
 }
 
@@ -431,7 +454,7 @@ void flushOutgoingMessages(int clientSock, struct client_frame *locals) {
 		memmove(locals->sendQueue, locals->sendQueue + i, sizeof(void *) * (queue_len + 1));
 	}
 	if (locals->sendQueue[0] == NULL) {
-		*locals->pollEvents &= ~POLLOUT;
+		setEvents(locals, locals->events & ~EPOLLOUT);
 		if (locals->state == CLIENT_CLOSING) locals->state = CLIENT_CLOSED;
 	}
 }
@@ -458,11 +481,89 @@ void queueMessage(struct client_frame *client, uint8_t *message) {
 	}
 	client->sendQueue[i] = message;
 	client->sendQueue[i+1] = NULL;
-	*client->pollEvents |= POLLOUT;
+	setEvents(client, client->events | EPOLLOUT);
+}
+
+void setEvents(struct client_frame *client, uint32_t events) {
+	if (events == client->events) return;
+	client->events = events;
+	struct epoll_event ev = { .events = events, .data.ptr = client };
+	if (epoll_ctl(epollFd, EPOLL_CTL_MOD, client->sock, &ev) < 0) {
+		perror("epoll_ctl() failed");
+		client->state = CLIENT_CLOSED;
+	}
+}
+
+static void swapDeadlines(size_t a, size_t b) {
+	struct client_frame *tmp = deadlines[a];
+	deadlines[a] = deadlines[b];
+	deadlines[b] = tmp;
+	deadlines[a]->deadline = a + 1;
+	deadlines[b]->deadline = b + 1;
+}
+
+// Move the entry at i up or down to where its ttl belongs
+static void siftDeadline(size_t i) {
+	while (i > 0 && deadlines[(i - 1) / 2]->ttl > deadlines[i]->ttl) {
+		swapDeadlines(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		size_t min = i, child = 2 * i + 1;
+		if (child < deadlines_len && deadlines[child]->ttl < deadlines[min]->ttl) min = child;
+		if (child + 1 < deadlines_len && deadlines[child + 1]->ttl < deadlines[min]->ttl) min = child + 1;
+		if (min == i) break;
+		swapDeadlines(i, min);
+		i = min;
+	}
+}
+
+// A ttl of 0 means the client has no deadline
+void setDeadline(struct client_frame *client, time_t ttl) {
+	size_t i = client->deadline;
+	client->ttl = ttl;
+	if (!i) {
+		if (!ttl) return;
+		if (deadlines_len == deadlines_cap) {
+			deadlines_cap = deadlines_cap ? 2 * deadlines_cap : 64;
+			deadlines = realloc(deadlines, sizeof(*deadlines) * deadlines_cap);
+		}
+		deadlines[deadlines_len++] = client;
+		client->deadline = i = deadlines_len;
+	} else if (!ttl) {
+		struct client_frame *last = deadlines[--deadlines_len];
+		client->deadline = 0;
+		if (last == client) return;
+		deadlines[i - 1] = last; // The last entry fills the hole
+		last->deadline = i;
+	}
+	siftDeadline(i - 1);
+}
+
+// Close clients whose handshake ran out of time, returns the epoll_wait timeout until the next one
+int expireClients() {
+	if (!deadlines_len) return -1;
+	time_t now = time(NULL);
+	while (deadlines_len && deadlines[0]->ttl <= now) {
+		deadlines[0]->state = CLIENT_CLOSED;
+		closeClient(deadlines[0]);
+	}
+	return deadlines_len ? 1000 * (deadlines[0]->ttl - now) : -1;
+}
+
+void closeClient(struct client_frame *client) {
+	close(client->sock); // Also takes it out of epoll
+	destroyClient(client);
+	if (acceptPaused) { // A descriptor is free again
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, servSock, &ev);
+		acceptPaused = 0;
+	}
 }
 
 void destroyClient(struct client_frame *client) {
-	if (clients) HASH_DEL(clients, client);
+	if (client->hh.tbl) HASH_DEL(clients, client); // Only clients past the handshake are hashed
+	setDeadline(client, 0);
 	handleLeave(client->room);
 	for (int i = 0; client->sendQueue[i] != NULL; i++) free(client->sendQueue[i]);
 	free(client->recvBuf);
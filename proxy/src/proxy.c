@@ -0,0 +1,760 @@
+/**
+ * Network impairment proxy
+ * Relays UDP datagrams or TCP streams between clients and one server while
+ * injecting loss, delay, jitter, reordering and a bandwidth limit.
+ * @author Kyle Herock
+ */
+
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+
+#include <argp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uthash.h"
+
+#define BATCH 64 // Datagrams moved per recvmmsg()/sendmmsg()
+#define DGRAM_LEN 65536
+#define CHUNK_LEN 16384 // Bytes read from a TCP stream at a time
+#define OUTBUF_MAX (4 << 20) // Stop reading a stream when this much is waiting to be written
+#define MAX_EVENTS 64
+#define QUEUE0 1000 // Default datagrams a direction may hold before tail-dropping, as in netem
+#define IDLE0 120 // Default seconds a UDP session may go without traffic before it is closed
+
+enum direction { TO_SERVER, TO_CLIENT };
+
+// What kind of epoll registration an event's data.ptr refers to
+enum fd_kind { FD_LISTEN, FD_TIMER, FD_UPSTREAM, FD_DOWNSTREAM };
+
+struct proxy_arguments {
+	struct sockaddr_in servAddr;
+	int port;
+	int tcp;
+	double loss; // probability
+	double reorder; // probability
+	uint64_t delay; // ns
+	uint64_t jitter; // ns
+	uint64_t rate; // bits per second, 0 for unlimited
+	uint64_t seed;
+	int limit; // datagrams queued per direction
+	uint64_t idle; // ns a UDP session may go quiet
+};
+
+struct fd_ref {
+	enum fd_kind kind;
+	struct session *session;
+};
+
+// Bytes that are due but couldn't be written to a stream yet
+struct outbuf {
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+};
+
+// One client's traffic: a UDP source address or an accepted TCP connection
+struct session {
+	struct sockaddr_in client; // The key for uthash (UDP only)
+	int upstream; // Connected to the server
+	int downstream; // Accepted connection (TCP), -1 for UDP
+	struct fd_ref upRef, downRef;
+	struct outbuf out[2]; // TCP only
+	size_t queued[2]; // TCP: bytes scheduled but not yet delivered
+	uint64_t lastDue[2]; // Streams can't be reordered, so jitter never lets a chunk overtake
+	int eof[2]; // TCP: the source of this direction has closed
+	int shut[2]; // TCP: that EOF has been delivered, so shut down writing once drained
+	int refs; // Packets still scheduled for this session, plus one while it is open
+	int connecting; // TCP: the upstream connect() hasn't finished yet
+	int dead;
+	uint64_t lastSeen; // UDP: when a datagram last went either way
+	struct session *older, *newer; // UDP: neighbors in order of last traffic
+	struct session *nextDead;
+	UT_hash_handle hh;
+};
+
+struct packet {
+	uint64_t due;
+	uint64_t seq; // Breaks ties so equal deadlines keep arrival order
+	struct session *session;
+	enum direction dir;
+	size_t len;
+	uint8_t data[];
+};
+
+struct packet_heap {
+	struct packet **a;
+	size_t len;
+	size_t cap;
+};
+
+struct link_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t dropped;
+	uint64_t reordered;
+};
+
+static struct proxy_arguments args;
+static struct session *sessions = NULL;
+static struct packet_heap schedule;
+static struct link_stats stats[2];
+static int queued[2]; // Datagrams scheduled in each direction
+static struct session *graveyard = NULL; // Freed once no epoll event can refer to them
+static struct session *oldest = NULL, *newest = NULL; // UDP sessions, least recently used first
+static uint64_t linkFree[2]; // When each direction's link finishes serializing its last packet
+static uint64_t nextSeq;
+static uint64_t rngState;
+static int epfd, listenSock, timerFd;
+static struct fd_ref listenRef = { FD_LISTEN, NULL }, timerRef = { FD_TIMER, NULL };
+static volatile sig_atomic_t stopping = 0;
+
+error_t proxy_parser(int key, char *arg, struct argp_state *state) {
+	struct proxy_arguments *args = state->input;
+	error_t ret = 0;
+	int num;
+	double val;
+	switch (key) {
+	case 'l':
+		args->port = atoi(arg);
+		if (args->port <= 0) {
+			argp_error(state, "Invalid option for a port, must be a number greater than 0");
+		}
+		break;
+	case 'a':
+		args->servAddr.sin_family = AF_INET;
+		if (!inet_pton(AF_INET, arg, &args->servAddr.sin_addr.s_addr)) {
+			argp_error(state, "Invalid address");
+		}
+		break;
+	case 'p':
+		num = atoi(arg);
+		if (num <= 0) {
+			argp_error(state, "Invalid option for a port, must be a number greater than 0");
+		}
+		args->servAddr.sin_port = htons(num);
+		break;
+	case 'T':
+		args->tcp = 1;
+		break;
+	case 'd':
+		val = atof(arg);
+		if (val < 0 || val > 100) {
+			argp_error(state, "Percentage must be between 0 and 100");
+		}
+		args->loss = val / 100.0;
+		break;
+	case 'r':
+		val = atof(arg);
+		if (val < 0 || val > 100) {
+			argp_error(state, "Percentage must be between 0 and 100");
+		}
+		args->reorder = val / 100.0;
+		break;
+	case 'D':
+		val = atof(arg);
+		if (val < 0) {
+			argp_error(state, "delay must be a number of milliseconds >= 0");
+		}
+		args->delay = val * 1000000;
+		break;
+	case 'j':
+		val = atof(arg);
+		if (val < 0) {
+			argp_error(state, "jitter must be a number of milliseconds >= 0");
+		}
+		args->jitter = val * 1000000;
+		break;
+	case 'b':
+		val = atof(arg);
+		if (val < 0) {
+			argp_error(state, "bandwidth must be a number of kbit/s >= 0");
+		}
+		args->rate = val * 1000;
+		break;
+	case 's':
+		args->seed = strtoull(arg, NULL, 0);
+		break;
+	case 'q':
+		args->limit = atoi(arg);
+		if (args->limit <= 0) {
+			argp_error(state, "queue limit must be a number of datagrams > 0");
+		}
+		break;
+	case 'i':
+		num = atoi(arg);
+		if (num <= 0) {
+			argp_error(state, "idle timeout must be a number of seconds > 0");
+		}
+		args->idle = (uint64_t)num * 1000000000;
+		break;
+	default:
+		ret = ARGP_ERR_UNKNOWN;
+		break;
+	}
+	return ret;
+}
+
+void proxy_parseopt(struct proxy_arguments *args, int argc, char *argv[]) {
+	struct argp_option options[] = {
+		{ "listen", 'l', "port", 0, "The local port clients connect to", 0 },
+		{ "addr", 'a', "addr", 0, "The IP address of the server being proxied", 0 },
+		{ "port", 'p', "port", 0, "The port of the server being proxied", 0 },
+		{ "tcp", 'T', 0, 0, "Relay TCP streams instead of UDP datagrams. Loss and reordering don't apply", 0 },
+		{ "loss", 'd', "percent", 0, "The percent chance a datagram is dropped", 0 },
+		{ "reorder", 'r', "percent", 0, "The percent chance a datagram skips the delay and overtakes queued ones", 0 },
+		{ "delay", 'D', "ms", 0, "Added one-way delay in milliseconds", 0 },
+		{ "jitter", 'j', "ms", 0, "Delay varies uniformly by up to this many milliseconds either way", 0 },
+		{ "bandwidth", 'b', "kbit/s", 0, "Serialization rate of each direction. Unlimited by default", 0 },
+		{ "seed", 's', "seed", 0, "Seed for the impairment RNG, so runs can be repeated. 1 by default", 0 },
+		{ "queue", 'q', "packets", 0, "Datagrams each direction may hold before new ones are dropped. 1000 by default", 0 },
+		{ "idle", 'i', "seconds", 0, "A UDP session with no traffic either way for this long is closed. 120 by default", 0 },
+		{0}
+	};
+	struct argp argp_settings = { options, proxy_parser, 0, 0, 0, 0, 0 };
+
+	memset(args, 0, sizeof(*args));
+	args->seed = 1;
+	args->limit = QUEUE0;
+	args->idle = (uint64_t)IDLE0 * 1000000000;
+	if (argp_parse(&argp_settings, argc, argv, 0, NULL, args) != 0) {
+		fputs("Got an error condition when parsing\n", stderr);
+		exit(EX_USAGE);
+	}
+	if (!args->port) {
+		fputs("listen port must be specified\n", stderr);
+		exit(EX_USAGE);
+	}
+	if (!args->servAddr.sin_addr.s_addr || !args->servAddr.sin_port) {
+		fputs("server addr and port must be specified\n", stderr);
+		exit(EX_USAGE);
+	}
+}
+
+uint64_t monotonicNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// splitmix64, so a given seed and arrival order always impair the same packets
+uint64_t rng_next() {
+	uint64_t z = (rngState += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+double rng_uniform() {
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int packet_before(struct packet *a, struct packet *b) {
+	return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+void heap_push(struct packet_heap *h, struct packet *p) {
+	if (h->len == h->cap) {
+		h->cap = h->cap ? 2 * h->cap : 1024;
+		h->a = realloc(h->a, h->cap * sizeof(struct packet *));
+	}
+	size_t i = h->len++;
+	while (i > 0 && packet_before(p, h->a[(i - 1) / 2])) {
+		h->a[i] = h->a[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->a[i] = p;
+}
+
+struct packet *heap_pop(struct packet_heap *h) {
+	struct packet *top = h->a[0], *last = h->a[--h->len];
+	size_t i = 0, child;
+	while ((child = 2 * i + 1) < h->len) {
+		if (child + 1 < h->len && packet_before(h->a[child + 1], h->a[child])) child++;
+		if (!packet_before(h->a[child], last)) break;
+		h->a[i] = h->a[child];
+		i = child;
+	}
+	h->a[i] = last;
+	return top;
+}
+
+// Wake for the next packet due or the next UDP session to go idle, whichever is first
+void arm_timer() {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (schedule.len || oldest) {
+		uint64_t due = schedule.len ? schedule.a[0]->due : UINT64_MAX;
+		if (oldest && oldest->lastSeen + args.idle < due) due = oldest->lastSeen + args.idle;
+		if (!due) due = 1; // A zero it_value would disarm the timer
+		its.it_value.tv_sec = due / 1000000000;
+		its.it_value.tv_nsec = due % 1000000000;
+	}
+	if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime() failed");
+		exit(1);
+	}
+}
+
+void watch(int fd, uint32_t events, struct fd_ref *ref, int op) {
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = ref;
+	if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+		perror("epoll_ctl() failed");
+		exit(1);
+	}
+}
+
+/**
+ * Decide the fate of len bytes that just arrived heading in direction dir:
+ * drop them, or schedule them to leave after the configured delay, jitter
+ * and the time the link needs to serialize everything ahead of them.
+ */
+void impair(struct session *s, enum direction dir, uint8_t *data, size_t len, uint64_t now) {
+	if (!args.tcp && ((args.loss > 0 && rng_uniform() < args.loss) || queued[dir] >= args.limit)) {
+		stats[dir].dropped++;
+		return;
+	}
+	uint64_t due = now;
+	if (!args.tcp && args.reorder > 0 && rng_uniform() < args.reorder) {
+		stats[dir].reordered++;
+	} else {
+		int64_t delay = args.delay;
+		if (args.jitter) delay += (int64_t)((2 * rng_uniform() - 1) * args.jitter);
+		if (delay > 0) due += delay;
+	}
+	if (args.tcp) {
+		if (due < s->lastDue[dir]) due = s->lastDue[dir];
+		s->lastDue[dir] = due;
+	}
+	if (args.rate) {
+		if (due < linkFree[dir]) due = linkFree[dir];
+		due += len * 8 * 1000000000 / args.rate;
+		linkFree[dir] = due;
+	}
+	struct packet *p = malloc(sizeof(struct packet) + len);
+	p->due = due;
+	p->seq = nextSeq++;
+	p->session = s;
+	p->dir = dir;
+	p->len = len;
+	memcpy(p->data, data, len);
+	s->refs++;
+	if (args.tcp) {
+		s->queued[dir] += len;
+	} else {
+		queued[dir]++;
+	}
+	heap_push(&schedule, p);
+}
+
+// Take a UDP session out of the order of last traffic
+void unlink_session(struct session *s) {
+	if (s->older) s->older->newer = s->newer;
+	else if (oldest == s) oldest = s->newer;
+	if (s->newer) s->newer->older = s->older;
+	else if (newest == s) newest = s->older;
+	s->older = s->newer = NULL;
+}
+
+// Note traffic on a UDP session, making it the last to go idle
+void touch_session(struct session *s, uint64_t now) {
+	s->lastSeen = now;
+	if (newest == s) return;
+	unlink_session(s);
+	s->older = newest;
+	if (newest) newest->newer = s;
+	else oldest = s;
+	newest = s;
+}
+
+void close_session(struct session *s) {
+	if (s->dead) return;
+	s->dead = 1;
+	close(s->upstream);
+	if (s->downstream >= 0) close(s->downstream);
+	if (!args.tcp) {
+		HASH_DEL(sessions, s);
+		unlink_session(s);
+	}
+}
+
+void release_session(struct session *s) {
+	if (--s->refs == 0 && s->dead) {
+		s->nextDead = graveyard;
+		graveyard = s;
+	}
+}
+
+void bury_sessions() {
+	while (graveyard) {
+		struct session *s = graveyard;
+		graveyard = s->nextDead;
+		free(s->out[TO_SERVER].buf);
+		free(s->out[TO_CLIENT].buf);
+		free(s);
+	}
+}
+
+// Returns NULL if the server can't be reached, and the client is turned away
+struct session *new_session(struct sockaddr_in *client, int downstream) {
+	struct session *s = calloc(1, sizeof(struct session));
+	if (client) s->client = *client;
+	s->downstream = downstream;
+	s->upstream = socket(AF_INET, args.tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (s->upstream < 0) {
+		perror("socket() failed");
+		if (downstream >= 0) close(downstream);
+		free(s);
+		return NULL;
+	}
+	// A TCP connect finishes on EPOLLOUT, so a slow server doesn't hold up the rest
+	fcntl(s->upstream, F_SETFL, O_NONBLOCK);
+	if (connect(s->upstream, (struct sockaddr *)&args.servAddr, sizeof(args.servAddr)) < 0) {
+		if (errno != EINPROGRESS) {
+			perror("connect() failed");
+			close(s->upstream);
+			if (downstream >= 0) close(downstream);
+			free(s);
+			return NULL;
+		}
+		s->connecting = 1;
+	}
+	s->upRef.kind = FD_UPSTREAM;
+	s->upRef.session = s;
+	s->refs = 1; // Held by the session table or the connection itself
+	watch(s->upstream, s->connecting ? EPOLLOUT : EPOLLIN, &s->upRef, EPOLL_CTL_ADD);
+	if (downstream >= 0) {
+		fcntl(downstream, F_SETFL, O_NONBLOCK);
+		s->downRef.kind = FD_DOWNSTREAM;
+		s->downRef.session = s;
+		watch(downstream, EPOLLIN, &s->downRef, EPOLL_CTL_ADD);
+	}
+	return s;
+}
+
+// Receive a batch of datagrams and schedule each of them
+void receive_datagrams(int fd, struct session *s, enum direction dir) {
+	static uint8_t bufs[BATCH][DGRAM_LEN];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH];
+	struct sockaddr_in addrs[BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = DGRAM_LEN;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	}
+	int numMsgs = recvmmsg(fd, msgs, BATCH, 0, NULL);
+	if (numMsgs < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) return;
+		perror("recvmmsg() failed");
+		exit(1);
+	}
+	uint64_t now = monotonicNanos();
+	for (int i = 0; i < numMsgs; i++) {
+		struct session *target = s;
+		if (!target) {
+			HASH_FIND(hh, sessions, &addrs[i], sizeof(addrs[i]), target);
+			if (!target) {
+				target = new_session(&addrs[i], -1);
+				if (!target) continue;
+				HASH_ADD(hh, sessions, client, sizeof(target->client), target);
+			}
+		}
+		touch_session(target, now);
+		impair(target, dir, bufs[i], msgs[i].msg_len, now);
+	}
+}
+
+// Read and write interest for both sockets of a stream, given its backlogs
+void update_stream_events(struct session *s) {
+	size_t backlog[2] = { s->queued[TO_SERVER] + s->out[TO_SERVER].len, s->queued[TO_CLIENT] + s->out[TO_CLIENT].len };
+	uint32_t down = (s->eof[TO_SERVER] || backlog[TO_SERVER] > OUTBUF_MAX ? 0 : EPOLLIN)
+		| (s->out[TO_CLIENT].len ? EPOLLOUT : 0);
+	uint32_t up = (s->eof[TO_CLIENT] || backlog[TO_CLIENT] > OUTBUF_MAX ? 0 : EPOLLIN)
+		| (s->out[TO_SERVER].len ? EPOLLOUT : 0);
+	if (s->connecting) up = EPOLLOUT;
+	watch(s->downstream, down, &s->downRef, EPOLL_CTL_MOD);
+	watch(s->upstream, up, &s->upRef, EPOLL_CTL_MOD);
+}
+
+// Read one chunk from a stream. EOF travels through the schedule as an empty chunk.
+void receive_stream(int fd, struct session *s, enum direction dir) {
+	uint8_t buf[CHUNK_LEN];
+	ssize_t numBytes = recv(fd, buf, sizeof(buf), 0);
+	if (numBytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+		close_session(s);
+		release_session(s);
+		return;
+	}
+	if (numBytes == 0) s->eof[dir] = 1;
+	impair(s, dir, buf, numBytes, monotonicNanos());
+	update_stream_events(s);
+}
+
+// Write as much of a stream's backlog as the socket takes
+void flush_stream(struct session *s, enum direction dir) {
+	struct outbuf *out = &s->out[dir];
+	int fd = dir == TO_SERVER ? s->upstream : s->downstream;
+	size_t off = 0;
+	if (dir == TO_SERVER && s->connecting) return; // Held until the connection is up
+	while (off < out->len) {
+		ssize_t numBytes = send(fd, out->buf + off, out->len - off, MSG_NOSIGNAL);
+		if (numBytes <= 0) {
+			if (numBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			close_session(s);
+			release_session(s);
+			return;
+		}
+		off += numBytes;
+	}
+	memmove(out->buf, out->buf + off, out->len - off);
+	out->len -= off;
+	if (out->len || !s->shut[dir]) return;
+	shutdown(fd, SHUT_WR);
+	if (s->shut[!dir] && !s->out[!dir].len) {
+		close_session(s); // Both directions have delivered their EOF
+		release_session(s);
+	}
+}
+
+// The upstream connect() has finished one way or the other
+void finish_connect(struct session *s) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (getsockopt(s->upstream, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+	if (err) {
+		fprintf(stderr, "connect() failed: %s\n", strerror(err));
+		close_session(s);
+		release_session(s);
+		return;
+	}
+	s->connecting = 0;
+	flush_stream(s, TO_SERVER); // What the client sent in the meantime
+	if (!s->dead) update_stream_events(s);
+}
+
+void deliver_stream(struct packet *p) {
+	struct session *s = p->session;
+	struct outbuf *out = &s->out[p->dir];
+	s->queued[p->dir] -= p->len;
+	if (!p->len) s->shut[p->dir] = 1;
+	if (out->len + p->len > out->cap) {
+		out->cap = 2 * (out->len + p->len);
+		out->buf = realloc(out->buf, out->cap);
+	}
+	memcpy(out->buf + out->len, p->data, p->len);
+	out->len += p->len;
+	flush_stream(s, p->dir);
+	if (!s->dead) update_stream_events(s);
+}
+
+/**
+ * Send everything whose time has come. Consecutive datagrams leaving through
+ * the same socket go out in one sendmmsg().
+ */
+void send_due() {
+	struct packet *due[BATCH];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH];
+	uint64_t now = monotonicNanos();
+	while (schedule.len && schedule.a[0]->due <= now) {
+		int len = 0;
+		while (len < BATCH && schedule.len && schedule.a[0]->due <= now) {
+			due[len++] = heap_pop(&schedule);
+		}
+		if (!args.tcp) {
+			for (int i = 0; i < len; i++) queued[due[i]->dir]--;
+		}
+		for (int i = 0; i < len; i++) {
+			struct packet *p = due[i];
+			struct session *s = p->session;
+			if (args.tcp) {
+				if (!s->dead) {
+					stats[p->dir].packets++;
+					stats[p->dir].bytes += p->len;
+					deliver_stream(p);
+				}
+				continue;
+			}
+			int n = 0, fd = p->dir == TO_SERVER ? s->upstream : listenSock;
+			for (int j = i; j < len && !due[j]->session->dead; j++) {
+				int jfd = due[j]->dir == TO_SERVER ? due[j]->session->upstream : listenSock;
+				if (jfd != fd) break;
+				memset(&msgs[n], 0, sizeof(msgs[n]));
+				iovs[n].iov_base = due[j]->data;
+				iovs[n].iov_len = due[j]->len;
+				msgs[n].msg_hdr.msg_iov = &iovs[n];
+				msgs[n].msg_hdr.msg_iovlen = 1;
+				if (due[j]->dir == TO_CLIENT) {
+					msgs[n].msg_hdr.msg_name = &due[j]->session->client;
+					msgs[n].msg_hdr.msg_namelen = sizeof(due[j]->session->client);
+				}
+				n++;
+			}
+			int sent = n ? sendmmsg(fd, msgs, n, 0) : 0;
+			if (sent < 0) {
+				if (errno != EAGAIN && errno != ECONNREFUSED) perror("sendmmsg() failed");
+				sent = 0;
+			}
+			// What the socket would not take is lost, as it would be on the wire
+			for (int j = 0; j < n; j++) {
+				struct packet *q = due[i + j];
+				if (j < sent) {
+					stats[q->dir].packets++;
+					stats[q->dir].bytes += q->len;
+				} else {
+					stats[q->dir].dropped++;
+				}
+			}
+			i += n ? n - 1 : 0;
+		}
+		for (int i = 0; i < len; i++) {
+			release_session(due[i]->session);
+			free(due[i]);
+		}
+	}
+}
+
+// Close UDP sessions nothing has gone through for args.idle
+void expire_sessions() {
+	uint64_t now = monotonicNanos();
+	while (oldest && oldest->lastSeen + args.idle <= now) {
+		struct session *s = oldest;
+		close_session(s);
+		release_session(s);
+	}
+}
+
+void handle_signal(int sig) {
+	(void)sig;
+	stopping = 1;
+}
+
+void print_stats() {
+	char *names[2] = { "to-server", "to-client" };
+	for (int dir = TO_SERVER; dir <= TO_CLIENT; dir++) {
+		printf("%s packets %lu bytes %lu dropped %lu reordered %lu\n", names[dir],
+			(unsigned long)stats[dir].packets, (unsigned long)stats[dir].bytes,
+			(unsigned long)stats[dir].dropped, (unsigned long)stats[dir].reordered);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	proxy_parseopt(&args, argc, argv);
+	rngState = args.seed;
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	listenSock = socket(AF_INET, args.tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (listenSock < 0) {
+		perror("socket() failed");
+		exit(1);
+	}
+	int on = 1;
+	setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	fcntl(listenSock, F_SETFL, O_NONBLOCK);
+
+	struct sockaddr_in localAddr;
+	memset(&localAddr, 0, sizeof(localAddr));
+	localAddr.sin_family = AF_INET;
+	localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	localAddr.sin_port = htons(args.port);
+	if (bind(listenSock, (struct sockaddr *)&localAddr, sizeof(localAddr)) < 0) {
+		perror("bind() failed");
+		exit(1);
+	}
+	if (args.tcp && listen(listenSock, SOMAXCONN) < 0) {
+		perror("listen() failed");
+		exit(1);
+	}
+
+	epfd = epoll_create1(0);
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (epfd < 0 || timerFd < 0) {
+		perror("epoll/timerfd setup failed");
+		exit(1);
+	}
+	watch(listenSock, EPOLLIN, &listenRef, EPOLL_CTL_ADD);
+	watch(timerFd, EPOLLIN, &timerRef, EPOLL_CTL_ADD);
+
+	struct epoll_event events[MAX_EVENTS];
+	while (!stopping) {
+		int numEvents = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (numEvents < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait() failed");
+			exit(1);
+		}
+		for (int i = 0; i < numEvents; i++) {
+			struct fd_ref *ref = events[i].data.ptr;
+			struct session *s = ref->session;
+			uint64_t expirations;
+			if (s && s->dead) continue;
+			switch (ref->kind) {
+			case FD_LISTEN:
+				if (!args.tcp) {
+					receive_datagrams(listenSock, NULL, TO_SERVER);
+				} else {
+					int clientSock = accept(listenSock, NULL, NULL);
+					if (clientSock >= 0) new_session(NULL, clientSock);
+				}
+				break;
+			case FD_TIMER:
+				if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+					perror("read(timerfd) failed");
+				}
+				break;
+			case FD_UPSTREAM:
+				if (s->connecting) {
+					finish_connect(s);
+					break;
+				}
+				if (events[i].events & EPOLLOUT) {
+					flush_stream(s, TO_SERVER);
+					if (!s->dead) update_stream_events(s);
+				}
+				if (s->dead) break;
+				if (!args.tcp) {
+					receive_datagrams(s->upstream, s, TO_CLIENT);
+				} else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					receive_stream(s->upstream, s, TO_CLIENT);
+				}
+				break;
+			case FD_DOWNSTREAM:
+				if (events[i].events & EPOLLOUT) {
+					flush_stream(s, TO_CLIENT);
+					if (!s->dead) update_stream_events(s);
+				}
+				if (!s->dead && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					receive_stream(s->downstream, s, TO_SERVER);
+				}
+				break;
+			}
+		}
+		send_due();
+		expire_sessions();
+		arm_timer();
+		bury_sessions();
+	}
+	print_stats();
+	return 0;
+}